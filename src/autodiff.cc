@@ -1,127 +1,1322 @@
 #include "autodiff.hpp"
+#include "tape.hpp"
+#include "pool.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <utility>
 #include <vector>
 #include <iostream>
+#include <stdexcept>
+#include <functional>
 
 using std::array;
 using std::vector;
 using nn::Tensor;
+using nn::Shape;
 
-enum OpType{scalar, matmul, reduct};
+// Every thread records onto a tape of its own
+thread_local WengerntList tape;
+
+// Whether Var operations are currently recorded on the tape of the thread
+static thread_local bool recording = true;
+
+// Workers for the backward pass of the thread, null when it runs serially
+static thread_local std::unique_ptr<autodiff::WorkerPool> pool;
+
+// Locks for gradients written by several tasks, picked by tape index
+static std::array<std::mutex, 64> stripes;
+
+// Placeholder operand for unary operations
+static const Tensor no_operand;
+
+static const double root_half = 0.70710678118654752440;
+static const double inv_root_2pi = 0.39894228040143267794;
+
+static const std::string bias_err = "Biases must match the result or hold one value per row";
+static const std::string label_err = "Labels must hold one class index per column";
+static const std::string id_err = "Ids must hold one row of the table per column";
+static const std::string scale_err = "Normalisation scales and shifts must hold one value per row";
+
+// Reverses a periodic signal about its first element
+static Tensor flip(const Tensor& x) {
+    Tensor result(x.shape);
+    auto src = x.ptr();
+    auto dst = result.ptr();
+    dst[0] = src[0];
+    for(size_t i=1; i<x.size; ++i) {
+        dst[i] = src[x.size - i];
+    }
+    return result;
+}
+
+// Adds a bias to every column of x, or pointwise if the shapes match
+static void add_bias(Tensor& x, const Tensor& bias) {
+    auto x_ptr = x.ptr();
+    auto b_ptr = bias.ptr();
+    if(bias.shape == x.shape) {
+        for(size_t i=0; i<x.size; ++i) x_ptr[i] += b_ptr[i];
+        return;
+    }
+    auto cols = x.shape[0];
+    if(bias.size != x.size / cols || bias.shape[0] != 1) throw std::invalid_argument(bias_err);
+    for(size_t i=0; i<x.size; ++i) x_ptr[i] += b_ptr[i / cols];
+}
+
+// Adds x scaled by one value of scale per row to out
+static void add_scaled_rows(const Tensor& x, const Tensor& scale, Tensor& out) {
+    auto cols = x.shape[0];
+    if(scale.size != x.size / cols || scale.shape[0] != 1) throw std::invalid_argument(scale_err);
+    auto x_ptr = x.ptr();
+    auto s_ptr = scale.ptr();
+    auto out_ptr = out.ptr();
+    for(size_t i=0; i<x.size; ++i) out_ptr[i] += x_ptr[i] * s_ptr[i / cols];
+}
+
+// Adds the dot product of each row of a and b to one value per row of out
+static void add_row_dots(const Tensor& a, const Tensor& b, Tensor& out) {
+    auto cols = a.shape[0];
+    auto a_ptr = a.ptr();
+    auto b_ptr = b.ptr();
+    auto out_ptr = out.ptr();
+    for(size_t i=0; i<a.size; ++i) out_ptr[i / cols] += a_ptr[i] * b_ptr[i];
+}
+
+// Accumulates the gradient of a bias added by add_bias
+static void bias_grad(const Tensor& g, Tensor& gb) {
+    auto g_ptr = g.ptr();
+    auto gb_ptr = gb.ptr();
+    auto cols = gb.shape == g.shape ? 1 : g.shape[0];
+    for(size_t i=0; i<g.size; ++i) gb_ptr[i / cols] += g_ptr[i];
+}
+
+// a * log(x), zero wherever a is. The terms of pow that carry log(x) are
+// scaled by x^y, so this keeps them at their limit of zero at x = 0
+// rather than 0 * -inf.
+static Tensor times_log(const Tensor& a, const Tensor& x) {
+    Tensor result(a.shape);
+    auto a_ptr = a.ptr();
+    auto x_ptr = x.ptr();
+    auto r_ptr = result.ptr();
+    for(size_t i=0; i<a.size; ++i) r_ptr[i] = a_ptr[i] == 0 ? 0 : a_ptr[i] * std::log(x_ptr[i]);
+    return result;
+}
+
+// Derivative of an activation at x with output out, element i
+static double derivative(OpType type, const double* x, const double* out, size_t i) {
+    switch(type) {
+        case OpType::exp: return out[i];
+        case OpType::tanh: return 1 - out[i] * out[i];
+        case OpType::sigmoid: return out[i] * (1 - out[i]);
+        case OpType::relu: return out[i] > 0 ? 1 : 0;
+        case OpType::gelu: {
+            // Phi(x) + x phi(x)
+            auto cdf = 0.5 * (1 + std::erf(x[i] * root_half));
+            return cdf + x[i] * std::exp(-0.5 * x[i] * x[i]) * inv_root_2pi;
+        }
+        default: return 0;
+    }
+}
+
+// Writes or accumulates s o (v - sum(v o s)) over each column of a softmax
+// output s, its Jacobian applied to v. result may be v itself.
+static void softmax_product(const Tensor& s, const Tensor& v, Tensor& result, bool accumulate) {
+    auto cols = s.shape[0];
+    auto s_ptr = s.ptr();
+    auto v_ptr = v.ptr();
+    auto r_ptr = result.ptr();
+    vector<double> dots(cols, 0);
+    for(size_t i=0; i<s.size; ++i) dots[i % cols] += v_ptr[i] * s_ptr[i];
+    for(size_t i=0; i<s.size; ++i) {
+        auto value = s_ptr[i] * (v_ptr[i] - dots[i % cols]);
+        r_ptr[i] = accumulate ? r_ptr[i] + value : value;
+    }
+}
 
 /**
-    WegnerntNode
-    A node holding weights for variable parents
+    Heads
+    Views of the query, key and value rows stacked in a projection, with an
+    output of the query's shape
 */
-struct WegnerntNode{
-    array<size_t, 2> parents;
-    array<Tensor, 2> weights;
-    OpType type;
-    
-    WegnerntNode(size_t, size_t, const Tensor&, const Tensor&, OpType);
-    WegnerntNode(size_t, const Tensor&, OpType=scalar);
-    WegnerntNode();
+struct Heads {
+    Tensor q, k, v;
+
+    explicit Heads(const Tensor& qkv)
+    : q(qkv.ptr(), rows(qkv)), k(qkv.ptr() + q.size, q.shape), v(qkv.ptr() + 2 * q.size, q.shape) {}
+
+    static Shape rows(const Tensor& qkv) {
+        auto count = qkv.size / qkv.shape[0];
+        if(count % 3) throw std::invalid_argument("Attention projections must stack queries, keys and values");
+        return {{qkv.shape[0], count / 3, 1, 1}};
+    }
 };
 
-//  Two parent variable initialiser 
-WegnerntNode::WegnerntNode(size_t x_index, size_t y_index, const Tensor &x_weight, const Tensor &y_weight, OpType type_)
-: parents{{x_index, y_index}}, weights{{x_weight, y_weight}}, type(type_){}
+// Log of the softmax denominator of each column, exp(x - lse) is the softmax.
+// The maximum and the sum are kept together in a single pass over the rows,
+// the sum is rescaled whenever the maximum grows.
+static vector<double> log_sum_exp(const Tensor& x) {
+    auto cols = x.shape[0];
+    auto x_ptr = x.ptr();
+    vector<double> peak(x_ptr, x_ptr + cols);
+    vector<double> total(cols, 1);
+    for(size_t i=cols; i<x.size; ++i) {
+        auto c = i % cols;
+        if(x_ptr[i] > peak[c]) {
+            total[c] = total[c] * std::exp(peak[c] - x_ptr[i]) + 1;
+            peak[c] = x_ptr[i];
+        }
+        else total[c] += std::exp(x_ptr[i] - peak[c]);
+    }
+    for(size_t c=0; c<cols; ++c) peak[c] += std::log(total[c]);
+    return peak;
+}
 
-// One parent variable initialiser
-WegnerntNode::WegnerntNode(size_t index , const Tensor &weight, OpType type_)
-: parents{{index, 0}}, weights{{weight, Tensor()}}, type(type_){}
+// Row of x picked by the index of column c, such as the labelled class of
+// a column of logits or the id looked up in a table
+static size_t row_of(const Tensor& x, const Tensor& indices, size_t c, const std::string& err) {
+    auto value = indices.ptr()[c];
+    auto row = static_cast<size_t>(value);
+    if(value < 0 || row != value || row >= x.size / x.shape[0]) throw std::invalid_argument(err);
+    return row;
+}
 
-// Zero parent variable intialiser
-WegnerntNode::WegnerntNode()
-: parents{{0,0}}, weights{{Tensor(), Tensor()}}, type(scalar){}
+// Gathers row ids[b] of the table into column b of out
+static void gather(const Tensor& table, const Tensor& ids, Tensor& out) {
+    auto dim = table.shape[0];
+    auto cols = ids.size;
+    if(out.shape[0] != cols || out.size != cols * dim) throw std::invalid_argument(id_err);
+    auto t_ptr = table.ptr();
+    auto out_ptr = out.ptr();
+    for(size_t b=0; b<cols; ++b) {
+        auto row = t_ptr + row_of(table, ids, b, id_err) * dim;
+        for(size_t d=0; d<dim; ++d) out_ptr[d * cols + b] = row[d];
+    }
+}
+
+void embedding_vjp(const Tensor& g, const Tensor& ids, autodiff::RowGrad& rows) {
+    auto cols = g.shape[0];
+    for(size_t b=0; b<cols; ++b) rows.add(static_cast<size_t>(ids.ptr()[b]), g.ptr() + b, cols);
+}
+
+// Writes or accumulates scale * (softmax(x) - onehot(labels)), the gradient
+// of the mean cross-entropy scaled by the output gradient
+static void softmax_ce_grad(const Tensor& x, const Tensor& labels, double scale, Tensor& result, bool accumulate) {
+    auto cols = x.shape[0];
+    auto lse = log_sum_exp(x);
+    auto x_ptr = x.ptr();
+    auto r_ptr = result.ptr();
+    for(size_t i=0; i<x.size; ++i) {
+        auto value = scale * std::exp(x_ptr[i] - lse[i % cols]);
+        r_ptr[i] = accumulate ? r_ptr[i] + value : value;
+    }
+    for(size_t c=0; c<cols; ++c) r_ptr[row_of(x, labels, c, label_err) * cols + c] -= scale;
+}
 
 /**
-    WengerntList
-    A ticker tape which holds the nodes for each operation on a Variable
+    Norm
+    Statistics of a normalisation, batch norm normalises each row over the
+    batch and layer norm each column over its features. The scale and shift
+    hold one value per row for both.
 */
-struct WengerntList{
-    vector<WegnerntNode> nodes;
-    vector<Tensor> grads;
+struct Norm {
+    vector<double> mean, inv_std;
+    size_t cols, rows, n;
+    bool per_row;
+
+    Norm(OpType type, double eps, const Tensor& x, const Tensor& scale)
+    : cols(x.shape[0]), rows(x.size / x.shape[0]), per_row(type == OpType::batch_norm) {
+        if(scale.size != rows || scale.shape[0] != 1) throw std::invalid_argument(scale_err);
+        auto groups = per_row ? rows : cols;
+        n = per_row ? cols : rows;
+        Tensor m(groups), v(groups);
+        nn::moments(x, m, v, per_row);
+        mean.assign(m.ptr(), m.ptr() + groups);
+        inv_std.resize(groups);
+        for(size_t k=0; k<groups; ++k) inv_std[k] = 1 / std::sqrt(v.ptr()[k] + eps);
+    }
+
+    size_t group(size_t i) const { return per_row ? i / cols : i % cols; }
+    double normalised(const double* x, size_t i) const { return (x[i] - mean[group(i)]) * inv_std[group(i)]; }
+};
+
+// Writes the normalised x scaled by gamma and shifted by beta
+static void normalise(OpType type, double eps, const Tensor& x, const Tensor& gamma, const Tensor& beta, Tensor& out) {
+    Norm norm(type, eps, x, gamma);
+    if(beta.size != norm.rows) throw std::invalid_argument(scale_err);
+    auto x_ptr = x.ptr();
+    auto g_ptr = gamma.ptr();
+    auto b_ptr = beta.ptr();
+    auto out_ptr = out.ptr();
+    for(size_t i=0; i<x.size; ++i) {
+        auto r = i / norm.cols;
+        out_ptr[i] = g_ptr[r] * norm.normalised(x_ptr, i) + b_ptr[r];
+    }
+}
+
+// Accumulates the gradients of a normalisation in two passes, the first
+// sums h = g gamma and h xhat over each group along with the gradients of
+// gamma and beta, the second forms inv_std (h - mean(h) - xhat mean(h xhat))
+static void normalise_grad(OpType type, double eps, const Tensor& g, const Tensor& x, const Tensor& gamma,
+                           Tensor* gx, Tensor* g_gamma, Tensor* g_beta) {
+    Norm norm(type, eps, x, gamma);
+    auto groups = norm.mean.size();
+    vector<double> h_sum(groups, 0), hx_sum(groups, 0);
+    auto g_ptr = g.ptr();
+    auto x_ptr = x.ptr();
+    auto gamma_ptr = gamma.ptr();
+    for(size_t i=0; i<x.size; ++i) {
+        auto r = i / norm.cols;
+        auto k = norm.group(i);
+        auto xhat = norm.normalised(x_ptr, i);
+        auto h = g_ptr[i] * gamma_ptr[r];
+        h_sum[k] += h;
+        hx_sum[k] += h * xhat;
+        if(g_gamma) g_gamma->ptr()[r] += g_ptr[i] * xhat;
+        if(g_beta) g_beta->ptr()[r] += g_ptr[i];
+    }
+    if(!gx) return;
+    auto gx_ptr = gx->ptr();
+    for(size_t i=0; i<x.size; ++i) {
+        auto k = norm.group(i);
+        auto h = g_ptr[i] * gamma_ptr[i / norm.cols];
+        gx_ptr[i] += norm.inv_std[k] * (h - (h_sum[k] + norm.normalised(x_ptr, i) * hx_sum[k]) / norm.n);
+    }
+}
+
+Tensor apply(OpType type, double scalar, const Tensor& x, const Tensor& y, const Tensor& z) {
+    switch(type) {
+        case OpType::add: return x + y;
+        case OpType::sub: return x - y;
+        case OpType::mul: return x % y;
+        case OpType::div: return x / y;
+        case OpType::matmul: return x * y;
+        case OpType::scale: return x * scalar;
+        case OpType::pow_const: return nn::pow(x, scalar);
+        case OpType::pow: return nn::pow(x, y);
+        case OpType::log: return nn::log(x);
+        case OpType::sin: return nn::sin(x);
+        case OpType::cos: return nn::cos(x);
+        case OpType::tan: return nn::tan(x);
+        case OpType::asin: return nn::asin(x);
+        case OpType::acos: return nn::acos(x);
+        case OpType::atan: return nn::atan(x);
+        case OpType::sum: return Tensor({{1,1,1,1}}, x.sum());
+        case OpType::abs_sum: return Tensor({{1,1,1,1}}, x.abs_sum());
+        case OpType::conv_1d: return nn::conv_1d(x, y);
+        case OpType::exp: return nn::exp(x);
+        case OpType::tanh: return nn::tanh(x);
+        case OpType::sigmoid: return nn::sigmoid(x);
+        case OpType::relu: return nn::relu(x);
+        case OpType::gelu: return nn::gelu(x);
+        case OpType::softmax: return nn::softmax(x);
+        case OpType::batch_norm:
+        case OpType::layer_norm: {
+            Tensor result(x.shape);
+            normalise(type, scalar, x, y, z, result);
+            return result;
+        }
+        case OpType::lstm_seq:
+        case OpType::gru_seq: return recurrent(type, scalar, x, y);
+        case OpType::embedding: {
+            Tensor result(y.size, x.shape[0]);
+            gather(x, y, result);
+            return result;
+        }
+        case OpType::scale_shift: {
+            Tensor result(x.shape, 0);
+            apply(type, scalar, x, y, z, result);
+            return result;
+        }
+        case OpType::attention:
+        case OpType::causal_attention: {
+            Tensor result(Heads::rows(x));
+            apply(type, scalar, x, y, z, result);
+            return result;
+        }
+        case OpType::linear:
+        case OpType::linear_act:
+        case OpType::sq_err_sum:
+        case OpType::abs_err_sum:
+        case OpType::softmax_ce: {
+            Tensor result(type == OpType::linear || type == OpType::linear_act ? Shape{{y.shape[0], x.shape[1], 1, 1}} : Shape{{1,1,1,1}});
+            apply(type, scalar, x, y, z, result);
+            return result;
+        }
+        default: throw std::logic_error("Leaf nodes have no operation");
+    }
+}
+
+void apply(OpType type, double scalar, const Tensor& x, const Tensor& y, const Tensor& z, Tensor& out) {
+    auto x_ptr = x.ptr();
+    auto y_ptr = y.ptr();
+    auto out_ptr = out.ptr();
+    switch(type) {
+        case OpType::add:
+            for(size_t i=0; i<out.size; ++i) out_ptr[i] = x_ptr[i] + y_ptr[i];
+            break;
+        case OpType::sub:
+            for(size_t i=0; i<out.size; ++i) out_ptr[i] = x_ptr[i] - y_ptr[i];
+            break;
+        case OpType::mul:
+            for(size_t i=0; i<out.size; ++i) out_ptr[i] = x_ptr[i] * y_ptr[i];
+            break;
+        case OpType::div:
+            for(size_t i=0; i<out.size; ++i) out_ptr[i] = x_ptr[i] / y_ptr[i];
+            break;
+        case OpType::scale:
+            for(size_t i=0; i<out.size; ++i) out_ptr[i] = scalar * x_ptr[i];
+            break;
+        case OpType::matmul:
+            nn::matmul(x, y, out);
+            break;
+        case OpType::sum:
+            out_ptr[0] = x.sum();
+            break;
+        case OpType::abs_sum:
+            out_ptr[0] = x.abs_sum();
+            break;
+        case OpType::linear:
+            nn::matmul(x, y, out);
+            add_bias(out, z);
+            break;
+        case OpType::linear_act:
+            nn::matmul(x, y, out);
+            add_bias(out, z);
+            apply(static_cast<OpType>(static_cast<int>(scalar)), 0, out, out, out, out);
+            break;
+        case OpType::scale_shift:
+            out.zeros();
+            add_scaled_rows(x, y, out);
+            add_bias(out, z);
+            break;
+        case OpType::exp: nn::exp(x, out); break;
+        case OpType::tanh: nn::tanh(x, out); break;
+        case OpType::sigmoid: nn::sigmoid(x, out); break;
+        case OpType::relu: nn::relu(x, out); break;
+        case OpType::gelu: nn::gelu(x, out); break;
+        case OpType::softmax: nn::softmax(x, out); break;
+        case OpType::batch_norm:
+        case OpType::layer_norm: normalise(type, scalar, x, y, z, out); break;
+        case OpType::lstm_seq:
+        case OpType::gru_seq: recurrent(type, scalar, x, y, out); break;
+        case OpType::embedding: gather(x, y, out); break;
+        case OpType::attention:
+        case OpType::causal_attention: {
+            Heads heads(x);
+            nn::attention(heads.q, heads.k, heads.v, x.shape[0], static_cast<size_t>(scalar), 0,
+                          type == OpType::causal_attention, out);
+            break;
+        }
+        case OpType::sq_err_sum:
+        case OpType::abs_err_sum: {
+            if(x.shape != y.shape) throw std::invalid_argument("Tensor sizes do not match");
+            double total = 0;
+            for(size_t i=0; i<x.size; ++i) {
+                auto diff = x_ptr[i] - y_ptr[i];
+                total += type == OpType::sq_err_sum ? diff * diff : std::fabs(diff);
+            }
+            out_ptr[0] = total;
+            break;
+        }
+        case OpType::softmax_ce: {
+            // Mean over the columns of lse - x[label]
+            auto cols = x.shape[0];
+            if(y.size != cols) throw std::invalid_argument(label_err);
+            auto lse = log_sum_exp(x);
+            double total = 0;
+            for(size_t c=0; c<cols; ++c) total += lse[c] - x_ptr[row_of(x, y, c, label_err) * cols + c];
+            out_ptr[0] = total / cols;
+            break;
+        }
+        default:
+            out = apply(type, scalar, x, y, z);
+    }
+}
+
+void vjp(OpType type, double scalar, const Tensor& g, const Operands& in, Tensor* gx, Tensor* gy, Tensor* gz) {
+    auto &x = *in.x;
+    auto &y = *in.y;
+    switch(type) {
+        case OpType::add:
+            if(gx) *gx += g;
+            if(gy) *gy += g;
+            break;
+        case OpType::sub:
+            if(gx) *gx += g;
+            if(gy) *gy -= g;
+            break;
+        case OpType::mul:
+            if(gx) *gx += g % y;
+            if(gy) *gy += g % x;
+            break;
+        case OpType::div:
+            if(gx) *gx += g / y;
+            if(gy) *gy -= g % x / (y % y);
+            break;
+        case OpType::matmul:
+            if(gx) *gx += g * y.t();
+            if(gy) *gy += x.t() * g;
+            break;
+        case OpType::scale:
+            if(gx) *gx += g * scalar;
+            break;
+        case OpType::pow_const:
+            if(gx) *gx += g % nn::pow(x, scalar - 1) * scalar;
+            break;
+        case OpType::pow:
+            if(gx) *gx += g % y % nn::pow(x, y - Tensor(y.shape, 1));
+            if(gy) *gy += times_log(g % nn::pow(x, y), x);
+            break;
+        case OpType::log:
+            if(gx) *gx += g / x;
+            break;
+        case OpType::sin:
+            if(gx) *gx += g % nn::cos(x);
+            break;
+        case OpType::cos:
+            if(gx) *gx -= g % nn::sin(x);
+            break;
+        case OpType::tan: {
+            auto cos_x = nn::cos(x);
+            if(gx) *gx += g / (cos_x % cos_x);
+            break;
+        }
+        case OpType::asin:
+        case OpType::acos: {
+            // d/dx asin(x) = 1 / sqrt(1 - x^2) = -d/dx acos(x)
+            auto root = nn::sqrt(Tensor(x.shape, 1) - x % x);
+            if(!gx) break;
+            if(type == OpType::asin) *gx += g / root;
+            else *gx -= g / root;
+            break;
+        }
+        case OpType::atan:
+            if(gx) *gx += g / (Tensor(x.shape, 1) + x % x);
+            break;
+        case OpType::sum:
+            if(gx) {
+                auto g_0 = g.ptr()[0];
+                auto gx_ptr = gx->ptr();
+                for(size_t i=0; i<gx->size; ++i) gx_ptr[i] += g_0;
+            }
+            break;
+        case OpType::abs_sum:
+            if(gx) {
+                auto g_0 = g.ptr()[0];
+                auto x_ptr = x.ptr();
+                auto gx_ptr = gx->ptr();
+                for(size_t i=0; i<gx->size; ++i) {
+                    gx_ptr[i] += x_ptr[i] > 0 ? g_0 : (x_ptr[i] < 0 ? -g_0 : 0);
+                }
+            }
+            break;
+        case OpType::conv_1d:
+            // Circular convolution backpropagates as a correlation
+            if(gx) *gx += nn::conv_1d(g, flip(y));
+            if(gy) *gy += nn::conv_1d(g, flip(x));
+            break;
+        case OpType::linear:
+            if(gx) *gx += g * y.t();
+            if(gy) *gy += x.t() * g;
+            if(gz) bias_grad(g, *gz);
+            break;
+        case OpType::linear_act: {
+            // Back through the activation, written in terms of the output, then the product
+            Tensor pre(g.shape);
+            auto g_ptr = g.ptr();
+            auto out_ptr = in.out->ptr();
+            for(size_t i=0; i<g.size; ++i) {
+                pre.ptr()[i] = g_ptr[i] * derivative(static_cast<OpType>(static_cast<int>(scalar)), nullptr, out_ptr, i);
+            }
+            vjp(OpType::linear, 0, pre, in, gx, gy, gz);
+            break;
+        }
+        case OpType::scale_shift:
+            if(gx) add_scaled_rows(g, y, *gx);
+            if(gy) add_row_dots(g, x, *gy);
+            if(gz) bias_grad(g, *gz);
+            break;
+        case OpType::exp:
+        case OpType::tanh:
+        case OpType::sigmoid:
+        case OpType::relu:
+        case OpType::gelu: {
+            if(!gx) break;
+            auto g_ptr = g.ptr();
+            auto gx_ptr = gx->ptr();
+            auto out_ptr = in.out ? in.out->ptr() : nullptr;
+            for(size_t i=0; i<g.size; ++i) gx_ptr[i] += g_ptr[i] * derivative(type, x.ptr(), out_ptr, i);
+            break;
+        }
+        case OpType::softmax:
+            if(gx) softmax_product(*in.out, g, *gx, true);
+            break;
+        case OpType::sq_err_sum:
+        case OpType::abs_err_sum: {
+            auto g_0 = g.ptr()[0];
+            auto x_ptr = x.ptr();
+            auto y_ptr = y.ptr();
+            auto gx_ptr = gx ? gx->ptr() : nullptr;
+            auto gy_ptr = gy ? gy->ptr() : nullptr;
+            for(size_t i=0; i<x.size; ++i) {
+                auto diff = x_ptr[i] - y_ptr[i];
+                auto d = type == OpType::sq_err_sum ? 2 * diff * g_0
+                    : (diff > 0 ? g_0 : (diff < 0 ? -g_0 : 0));
+                if(gx_ptr) gx_ptr[i] += d;
+                if(gy_ptr) gy_ptr[i] -= d;
+            }
+            break;
+        }
+        case OpType::batch_norm:
+        case OpType::layer_norm:
+            normalise_grad(type, scalar, g, x, y, gx, gy, gz);
+            break;
+        case OpType::lstm_seq:
+        case OpType::gru_seq:
+            recurrent_vjp(type, scalar, g, x, y, gx, gy);
+            break;
+        case OpType::embedding:
+            // Scattered into a dense table gradient, sparse tables go through embedding_vjp
+            if(gx) {
+                auto dim = gx->shape[0];
+                auto cols = g.shape[0];
+                for(size_t b=0; b<cols; ++b) {
+                    auto row = gx->ptr() + static_cast<size_t>(y.ptr()[b]) * dim;
+                    for(size_t d=0; d<dim; ++d) row[d] += g.ptr()[d * cols + b];
+                }
+            }
+            break;
+        case OpType::attention:
+        case OpType::causal_attention: {
+            // The output and log-sum-exp are recomputed rather than kept
+            if(!gx) break;
+            Heads heads(x), grads(*gx);
+            auto count = static_cast<size_t>(scalar);
+            auto causal = type == OpType::causal_attention;
+            Tensor out(heads.q.shape), lse(x.shape[0], count);
+            nn::attention(heads.q, heads.k, heads.v, x.shape[0], count, 0, causal, out, &lse);
+            nn::attention_grad(heads.q, heads.k, heads.v, out, lse, g, count, causal, grads.q, grads.k, grads.v);
+            break;
+        }
+        case OpType::softmax_ce:
+            // Labels are indices and have no gradient
+            if(gx) softmax_ce_grad(x, y, g.ptr()[0] / x.shape[0], *gx, true);
+            break;
+        default:
+            break;
+    }
+}
+
+void vjp_in_place(OpType type, double scalar, Tensor& g, const Operands& in) {
+    auto g_ptr = g.ptr();
+    auto x_ptr = in.x->ptr();
+    switch(type) {
+        case OpType::scale:
+            for(size_t i=0; i<g.size; ++i) g_ptr[i] *= scalar;
+            break;
+        case OpType::pow_const:
+            for(size_t i=0; i<g.size; ++i) g_ptr[i] *= scalar * std::pow(x_ptr[i], scalar - 1);
+            break;
+        case OpType::log:
+            for(size_t i=0; i<g.size; ++i) g_ptr[i] /= x_ptr[i];
+            break;
+        case OpType::sin:
+            for(size_t i=0; i<g.size; ++i) g_ptr[i] *= std::cos(x_ptr[i]);
+            break;
+        case OpType::cos:
+            for(size_t i=0; i<g.size; ++i) g_ptr[i] *= -std::sin(x_ptr[i]);
+            break;
+        case OpType::exp:
+        case OpType::tanh:
+        case OpType::sigmoid:
+        case OpType::relu:
+        case OpType::gelu: {
+            auto out_ptr = in.out ? in.out->ptr() : nullptr;
+            for(size_t i=0; i<g.size; ++i) g_ptr[i] *= derivative(type, x_ptr, out_ptr, i);
+            break;
+        }
+        case OpType::softmax:
+            softmax_product(*in.out, g, g, false);
+            break;
+        default:
+            // The gradient of x in add and sub is the output gradient itself
+            break;
+    }
+}
+
+// Tangent of the output of an operation given the tangents of its operands
+static Tensor jvp_op(OpType type, double scalar, const Tensor& x, const Tensor& y, const Tensor& out,
+                     const Tensor& dx, const Tensor& dy, const Tensor& dz) {
+    switch(type) {
+        case OpType::add: return dx + dy;
+        case OpType::sub: return dx - dy;
+        case OpType::mul: return dx % y + x % dy;
+        case OpType::div: return (dx - out % dy) / y;
+        case OpType::matmul: return dx * y + x * dy;
+        case OpType::scale: return dx * scalar;
+        case OpType::pow_const: return dx % nn::pow(x, scalar - 1) * scalar;
+        case OpType::pow: return times_log(out % dy, x) + y % nn::pow(x, y - Tensor(y.shape, 1)) % dx;
+        case OpType::log: return dx / x;
+        case OpType::sin: return dx % nn::cos(x);
+        case OpType::cos: return dx % nn::sin(x) * -1;
+        case OpType::tan: {
+            auto cos_x = nn::cos(x);
+            return dx / (cos_x % cos_x);
+        }
+        case OpType::asin: return dx / nn::sqrt(Tensor(x.shape, 1) - x % x);
+        case OpType::acos: return dx / nn::sqrt(Tensor(x.shape, 1) - x % x) * -1;
+        case OpType::atan: return dx / (Tensor(x.shape, 1) + x % x);
+        case OpType::sum: return Tensor({{1,1,1,1}}, dx.sum());
+        case OpType::conv_1d: return nn::conv_1d(dx, y) + nn::conv_1d(x, dy);
+        case OpType::linear: {
+            auto result = dx * y + x * dy;
+            add_bias(result, dz);
+            return result;
+        }
+        case OpType::scale_shift: {
+            Tensor result(x.shape, 0);
+            add_scaled_rows(dx, y, result);
+            add_scaled_rows(x, dy, result);
+            add_bias(result, dz);
+            return result;
+        }
+        case OpType::exp:
+        case OpType::tanh:
+        case OpType::sigmoid:
+        case OpType::relu:
+        case OpType::gelu: {
+            Tensor result(dx.shape);
+            auto dx_ptr = dx.ptr();
+            auto r_ptr = result.ptr();
+            for(size_t i=0; i<dx.size; ++i) r_ptr[i] = dx_ptr[i] * derivative(type, x.ptr(), out.ptr(), i);
+            return result;
+        }
+        case OpType::softmax: {
+            // The softmax Jacobian is symmetric so its JVP matches its VJP
+            Tensor result(dx.shape);
+            softmax_product(out, dx, result, false);
+            return result;
+        }
+        case OpType::abs_sum:
+        case OpType::sq_err_sum:
+        case OpType::abs_err_sum: {
+            // Against a zero y for abs_sum
+            auto x_ptr = x.ptr();
+            auto dx_ptr = dx.ptr();
+            auto paired = type != OpType::abs_sum;
+            double total = 0;
+            for(size_t i=0; i<x.size; ++i) {
+                auto diff = paired ? x_ptr[i] - y.ptr()[i] : x_ptr[i];
+                auto d_diff = paired ? dx_ptr[i] - dy.ptr()[i] : dx_ptr[i];
+                if(type == OpType::sq_err_sum) total += 2 * diff * d_diff;
+                else total += diff > 0 ? d_diff : (diff < 0 ? -d_diff : 0);
+            }
+            return Tensor({{1,1,1,1}}, total);
+        }
+        case OpType::batch_norm:
+        case OpType::layer_norm: {
+            // d xhat = inv_std (dx - mean(dx) - xhat mean(dx xhat)) over each group
+            Norm norm(type, scalar, x, y);
+            auto groups = norm.mean.size();
+            vector<double> d_mean(groups, 0), dx_mean(groups, 0);
+            auto x_ptr = x.ptr();
+            auto dx_ptr = dx.ptr();
+            for(size_t i=0; i<x.size; ++i) {
+                auto k = norm.group(i);
+                d_mean[k] += dx_ptr[i] / norm.n;
+                dx_mean[k] += dx_ptr[i] * norm.normalised(x_ptr, i) / norm.n;
+            }
+            Tensor result(x.shape);
+            auto r_ptr = result.ptr();
+            for(size_t i=0; i<x.size; ++i) {
+                auto r = i / norm.cols;
+                auto k = norm.group(i);
+                auto xhat = norm.normalised(x_ptr, i);
+                auto d_xhat = norm.inv_std[k] * (dx_ptr[i] - d_mean[k] - xhat * dx_mean[k]);
+                r_ptr[i] = dy.ptr()[r] * xhat + y.ptr()[r] * d_xhat + dz.ptr()[r];
+            }
+            return result;
+        }
+        case OpType::embedding: {
+            Tensor result(y.size, x.shape[0]);
+            gather(dx, y, result);
+            return result;
+        }
+        case OpType::softmax_ce: {
+            Tensor probs(x.shape);
+            softmax_ce_grad(x, y, 1.0 / x.shape[0], probs, false);
+            return Tensor({{1,1,1,1}}, nn::dot(probs, dx));
+        }
+        default: throw std::logic_error("Operation has no forward mode rule");
+    }
+}
+
+// Accumulates the derivative of a vector-Jacobian product along the
+// tangents of its operands with g held fixed, the second order term of
+// propagating a gradient's tangent. Zero for operations linear in their
+// operands or piecewise constant in their derivatives.
+static void vjp_dot(OpType type, double scalar, const Tensor& g, const Operands& in, const Operands& dot,
+                    Tensor* gx, Tensor* gy) {
+    auto &x = *in.x;
+    auto &y = *in.y;
+    auto &dx = *dot.x;
+    auto &dy = *dot.y;
+    switch(type) {
+        case OpType::mul:
+            if(gx) *gx += g % dy;
+            if(gy) *gy += g % dx;
+            break;
+        case OpType::scale_shift:
+            if(gx) add_scaled_rows(g, dy, *gx);
+            if(gy) add_row_dots(g, dx, *gy);
+            break;
+        case OpType::div: {
+            auto y_2 = y % y;
+            if(gx) *gx -= g % dy / y_2;
+            if(gy) *gy += g % (x % dy * 2 / y - dx) / y_2;
+            break;
+        }
+        case OpType::matmul:
+        case OpType::linear:
+            if(gx) *gx += g * dy.t();
+            if(gy) *gy += dx.t() * g;
+            break;
+        case OpType::pow_const:
+            if(gx) *gx += g % dx % nn::pow(x, scalar - 2) * (scalar * (scalar - 1));
+            break;
+        case OpType::pow: {
+            Tensor ones(y.shape, 1);
+            auto pow_1 = nn::pow(x, y - ones);
+            auto d_out = times_log(nn::pow(x, y) % dy, x) + y % pow_1 % dx;
+            if(gx) *gx += g % (pow_1 % dy + y % (times_log(pow_1 % dy, x) + (y - ones) % nn::pow(x, y - ones * 2) % dx));
+            if(gy) *gy += g % (times_log(d_out, x) + pow_1 % dx);
+            break;
+        }
+        case OpType::log:
+            if(gx) *gx -= g % dx / (x % x);
+            break;
+        case OpType::sin:
+            if(gx) *gx -= g % dx % nn::sin(x);
+            break;
+        case OpType::cos:
+            if(gx) *gx -= g % dx % nn::cos(x);
+            break;
+        case OpType::tan: {
+            auto cos_x = nn::cos(x);
+            if(gx) *gx += g % dx % nn::tan(x) * 2 / (cos_x % cos_x);
+            break;
+        }
+        case OpType::asin:
+        case OpType::acos: {
+            auto rest = Tensor(x.shape, 1) - x % x;
+            if(!gx) break;
+            auto d = g % dx % x / (rest % nn::sqrt(rest));
+            if(type == OpType::asin) *gx += d;
+            else *gx -= d;
+            break;
+        }
+        case OpType::atan: {
+            auto rest = Tensor(x.shape, 1) + x % x;
+            if(gx) *gx -= g % dx % x * 2 / (rest % rest);
+            break;
+        }
+        case OpType::sq_err_sum: {
+            auto d = (dx - dy) * (2 * g.ptr()[0]);
+            if(gx) *gx += d;
+            if(gy) *gy -= d;
+            break;
+        }
+        case OpType::conv_1d:
+            if(gx) *gx += nn::conv_1d(g, flip(dy));
+            if(gy) *gy += nn::conv_1d(g, flip(dx));
+            break;
+        case OpType::exp:
+        case OpType::tanh:
+        case OpType::sigmoid:
+        case OpType::gelu: {
+            if(!gx) break;
+            auto g_ptr = g.ptr();
+            auto dx_ptr = dx.ptr();
+            auto out_ptr = in.out ? in.out->ptr() : nullptr;
+            auto gx_ptr = gx->ptr();
+            for(size_t i=0; i<g.size; ++i) {
+                // Second derivative of the activation at element i
+                double second;
+                if(type == OpType::exp) second = out_ptr[i];
+                else if(type == OpType::tanh) second = -2 * out_ptr[i] * (1 - out_ptr[i] * out_ptr[i]);
+                else if(type == OpType::sigmoid) second = out_ptr[i] * (1 - out_ptr[i]) * (1 - 2 * out_ptr[i]);
+                else second = std::exp(-0.5 * x.ptr()[i] * x.ptr()[i]) * inv_root_2pi * (2 - x.ptr()[i] * x.ptr()[i]);
+                gx_ptr[i] += g_ptr[i] * second * dx_ptr[i];
+            }
+            break;
+        }
+        case OpType::softmax: {
+            // With ds = J dx, d(gx) = ds o (g - <g, s>) - s o <g, ds> per column
+            if(!gx) break;
+            auto &out = *in.out;
+            Tensor ds(out.shape);
+            softmax_product(out, dx, ds, false);
+            auto cols = out.shape[0];
+            vector<double> g_s(cols, 0), g_ds(cols, 0);
+            auto s_ptr = out.ptr();
+            auto ds_ptr = ds.ptr();
+            auto g_ptr = g.ptr();
+            auto gx_ptr = gx->ptr();
+            for(size_t i=0; i<out.size; ++i) {
+                g_s[i % cols] += g_ptr[i] * s_ptr[i];
+                g_ds[i % cols] += g_ptr[i] * ds_ptr[i];
+            }
+            for(size_t i=0; i<out.size; ++i) {
+                gx_ptr[i] += ds_ptr[i] * (g_ptr[i] - g_s[i % cols]) - s_ptr[i] * g_ds[i % cols];
+            }
+            break;
+        }
+        case OpType::softmax_ce: {
+            // The onehot term is constant, leaving the softmax Jacobian along dx
+            if(!gx) break;
+            auto s = nn::softmax(x);
+            Tensor ds(x.shape);
+            softmax_product(s, dx, ds, false);
+            *gx += ds * (g.ptr()[0] / x.shape[0]);
+            break;
+        }
+        default:
+            break;
+    }
+}
 
-    // Appends a zero parent variable to the tape
-    size_t push_0(){
-        auto size = nodes.size();
-        nodes.emplace_back(WegnerntNode(size, size, Tensor(), Tensor(), scalar));
-        return size;
+// Accumulates the gradient of an embedding into the rows of its table when
+// the table is sparse, returns whether it did
+static bool sparse_vjp(WengerntList& list, const WegnerntNode& node, const Tensor& g) {
+    if(node.type != OpType::embedding) return false;
+    auto rows = list.rows(node.parents[0]);
+    if(!rows) return false;
+    embedding_vjp(g, node.saved[1], *rows);
+    return true;
+}
+
+// Vector-Jacobian product of a node into the gradients of its parents.
+// Products with a sparse input read it from the node, and the weight
+// gradient only gains the columns of the rows that hold entries.
+static void node_vjp(const WengerntList& list, const WegnerntNode& node, const Tensor& g,
+                     Tensor* gx, Tensor* gy, Tensor* gz) {
+    if(node.type != OpType::sparse_linear) {
+        vjp(node.type, node.scalar, g, list.operands(node), gx, gy, gz);
+        return;
     }
+    if(gx) nn::matmul_add_t(g, *node.operand, *gx);
+    if(gz) bias_grad(g, *gz);
+}
 
-    // Appends a one parent variable to the tape
-    size_t push_1(size_t x_index, const Tensor &weight, OpType type=scalar){
-        auto size = nodes.size();
-        nodes.emplace_back(WegnerntNode(x_index, weight, type));
-        return size;
+// Whether vjp_dot has a rule for an operation
+static bool second_order(OpType type) {
+    switch(type) {
+        case OpType::batch_norm:
+        case OpType::layer_norm:
+        case OpType::lstm_seq:
+        case OpType::gru_seq:
+        case OpType::attention:
+        case OpType::causal_attention:
+            return false;
+        default:
+            return true;
     }
+}
 
-    // Appends a two parent variable to the tape
-    size_t push_2(size_t x_index, size_t y_index, const Tensor &x_weight, const Tensor &y_weight, OpType type) {
-        auto size = nodes.size();
-        nodes.emplace_back(WegnerntNode(x_index, y_index, x_weight, y_weight, type));
-        return size;
+// Whether a node's vector-Jacobian product shares its work between parents,
+// such as replaying a recurrence, so it runs as one task rather than per edge
+static bool whole_node(OpType type) {
+    switch(type) {
+        case OpType::lstm_seq:
+        case OpType::gru_seq:
+        case OpType::batch_norm:
+        case OpType::layer_norm:
+        case OpType::scale_shift:
+            return true;
+        default:
+            return false;
     }
+}
 
-    // Adds a gradient to the gradient tape
-    void push_grad(const nn::Shape& shape) {
-        grads.emplace_back(Tensor(shape,0));
+// Runs the vector-Jacobian products of the marked nodes from index down to
+// lowest as a DAG on the worker pool. Each parent edge is its own task, or
+// each node when whole_node, and a node's edges are released once every
+// edge into its gradient is done.
+// Gradients with a single writer are accumulated directly, shared ones are
+// formed in a scratch tensor and added under a lock. Returns false without
+// doing anything if a checkpoint has to be recomputed, as that records.
+static bool backward_parallel(size_t index, size_t lowest, const vector<char>& reached) {
+    // Tasks run on the pool's threads, which each have a tape and pool of their own
+    auto &list = tape;
+    auto workers = pool.get();
+    vector<std::atomic<size_t>> pending(index + 1);
+    for(size_t i=lowest; i<=index; ++i) {
+        if(!reached[i]) continue;
+        auto &node = list.nodes[i];
+        if(node.type == OpType::checkpoint) return false;
+        if(node.type == OpType::leaf) continue;
+        for(size_t k=0; k<3; ++k) {
+            auto parent = node.parents[k];
+            if(!list.requires_grad(parent)) continue;
+            // Allocated up front as the lazy allocation isn't thread safe
+            if(node.type != OpType::embedding || k != 0 || !list.rows(parent)) list.grad(parent);
+            ++pending[parent];
+        }
+    }
+    vector<size_t> writers(index + 1);
+    for(size_t i=lowest; i<=index; ++i) {
+        writers[i] = pending[i];
+    }
+
+    std::function<void(size_t)> release;
+    auto edge = [&](size_t i, size_t k) {
+        auto &node = list.nodes[i];
+        auto parent = node.parents[k];
+        auto &target = list.grads[parent];
+        array<Tensor*, 3> g{{nullptr, nullptr, nullptr}};
+        if(k == 0 && list.rows(parent)) {
+            std::lock_guard<std::mutex> guard(stripes[parent % stripes.size()]);
+            sparse_vjp(list, node, list.grads[i]);
+        }
+        else if(writers[parent] == 1) {
+            g[k] = &target;
+            node_vjp(list, node, list.grads[i], g[0], g[1], g[2]);
+        }
+        else {
+            Tensor partial(target.shape, 0);
+            g[k] = &partial;
+            node_vjp(list, node, list.grads[i], g[0], g[1], g[2]);
+            std::lock_guard<std::mutex> guard(stripes[parent % stripes.size()]);
+            target += partial;
+        }
+        if(--pending[parent] == 0) release(parent);
+    };
+    auto whole = [&](size_t i) {
+        auto &node = list.nodes[i];
+        array<Tensor*, 3> g{{nullptr, nullptr, nullptr}};
+        array<Tensor, 3> partial;
+        for(size_t k=0; k<3; ++k) {
+            auto parent = node.parents[k];
+            if(!list.requires_grad(parent)) continue;
+            if(writers[parent] == 1) g[k] = &list.grads[parent];
+            else {
+                partial[k].resize(list.grads[parent].shape);
+                partial[k].zeros();
+                g[k] = &partial[k];
+            }
+        }
+        node_vjp(list, node, list.grads[i], g[0], g[1], g[2]);
+        for(size_t k=0; k<3; ++k) {
+            auto parent = node.parents[k];
+            if(!g[k]) continue;
+            if(g[k] == &partial[k]) {
+                std::lock_guard<std::mutex> guard(stripes[parent % stripes.size()]);
+                list.grads[parent] += partial[k];
+            }
+            if(--pending[parent] == 0) release(parent);
+        }
+    };
+    release = [&](size_t i) {
+        auto &node = list.nodes[i];
+        if(node.type == OpType::leaf) {
+            if(node.hook) node.hook();
+            return;
+        }
+        if(whole_node(node.type)) {
+            workers->submit([&whole, i]{ whole(i); });
+            return;
+        }
+        for(size_t k=0; k<3; ++k) {
+            if(list.requires_grad(node.parents[k])) workers->submit([&edge, i, k]{ edge(i, k); });
+        }
+    };
+    release(index);
+    workers->wait();
+    return true;
+}
+
+// Hooked leaves reached from index, each with the node whose product
+// completes its gradient. Nodes run from the top down so that is the
+// lowest node reading the leaf, and the list is in order of it. A
+// checkpoint may add to any leaf when it is recomputed, so with one on the
+// way every hook is left to the end of the pass.
+static vector<std::pair<size_t, size_t>> due_hooks(size_t index, size_t lowest, const vector<char>& reached) {
+    vector<std::pair<size_t, size_t>> due;
+    if(!tape.hooked) return due;
+    vector<char> seen(index + 1, 0);
+    auto deferred = false;
+    for(size_t i=lowest; i<=index; ++i) {
+        if(!reached[i]) continue;
+        auto &node = tape.nodes[i];
+        if(node.type == OpType::checkpoint) deferred = true;
+        if(node.type == OpType::leaf) continue;
+        for(auto parent : node.parents) {
+            if(!tape.requires_grad(parent) || seen[parent]) continue;
+            auto &leaf = tape.nodes[parent];
+            if(leaf.type != OpType::leaf || !leaf.hook) continue;
+            seen[parent] = 1;
+            due.emplace_back(i, parent);
+        }
+    }
+    if(deferred) {
+        for(auto &entry : due) entry.first = 0;
+    }
+    return due;
+}
+
+/**
+    Pass
+    Claims the next nesting level of backward passes for its lifetime, with
+    scratch marks for it. The level is given back however the pass ends, so
+    an error part way through doesn't leave later passes nested.
+*/
+struct Pass{
+    size_t depth;
+    Pass() : depth(tape.depth++) {
+        if(tape.marks.size() == depth) tape.marks.emplace_back();
     }
-    
-    size_t size() { return nodes.size(); }
+    ~Pass() { --tape.depth; }
+    Pass(const Pass&) = delete;
+    void operator=(const Pass&) = delete;
+};
+
+// Backpropagates from index, seeding its gradient with seed or ones when
+// null. Only nodes at or above floor are visited, those below it receive
+// gradients without propagating them further.
+static void backward(size_t index, const Tensor* seed, size_t floor) {
+    Pass pass;
+    auto depth = pass.depth;
+    auto lowest = tape.mark(index, floor, tape.marks[depth]);
+    if(seed) tape.grad(index) += *seed;
+    else tape.grad(index).ones();
+    // Nested passes come from checkpoints, which already run serially
+    if(pool && depth == 0 && backward_parallel(index, lowest, tape.marks[depth])) return;
+    // Hooks only belong to the outermost pass
+    auto due = depth == 0 ? due_hooks(index, lowest, tape.marks[depth]) : vector<std::pair<size_t, size_t>>();
+    for(size_t i=index+1; i-- >lowest;){
+        while(!due.empty() && due.back().first > i) {
+            tape.nodes[due.back().second].hook();
+            due.pop_back();
+        }
+        if(!tape.marks[depth][i]) continue;
+        auto &node = tape.nodes[i];
+        if(node.type == OpType::leaf) continue;
+        if(node.type == OpType::checkpoint) {
+            // Recording the segment again may move the node, so run a copy
+            auto recompute = node.recompute;
+            recompute(i);
+            continue;
+        }
+        if(sparse_vjp(tape, node, tape.grads[i])) continue;
+        // Parents that are constants or were computed under a NoGradGuard are skipped
+        array<Tensor*, 3> g{{nullptr, nullptr, nullptr}};
+        for(size_t k=0; k<3; ++k) {
+            auto parent = node.parents[k];
+            if(tape.requires_grad(parent)) g[k] = &tape.grad(parent);
+        }
+        node_vjp(tape, node, tape.grads[i], g[0], g[1], g[2]);
+    } 
+    for(auto entry=due.rbegin(); entry!=due.rend(); ++entry) tape.nodes[entry->second].hook();
+}
 
-    auto begin() { return nodes.begin(); }
-    auto end(){ return nodes.end(); }
+/**
+    DropGuard
+    Drops everything recorded after start once it goes out of scope, for
+    passes that record on the tape only for their own use
+*/
+struct DropGuard{
+    size_t start;
+    explicit DropGuard(size_t start_) : start(start_) {}
+    ~DropGuard() { if(start <= tape.size()) tape.drop(start); }
+    DropGuard(const DropGuard&) = delete;
+    void operator=(const DropGuard&) = delete;
 };
 
-static WengerntList tape;
+/**
+    EnableGrad
+    Turns recording back on for its lifetime, used to recompute checkpoints
+    even if the backward pass was started under a NoGradGuard
+*/
+struct EnableGrad{
+    bool previous;
+    EnableGrad() : previous(recording) { recording = true; }
+    ~EnableGrad() { recording = previous; }
+};
 
 namespace autodiff {
 
 Var::Var(const Tensor& data_, size_t index_) :index(index_), data(data_){}
 
 Var::Var(const Tensor& data_) : data(data_){
-    index = tape.push_0(); 
-    tape.push_grad(data.shape);
+    index = recording ? tape.push_0(data) : untracked;
 }
 
 Var::Var(size_t x, size_t y, size_t z, size_t t) : data(Tensor(x,y,z,t)) {
-    index = tape.push_0();
-    tape.push_grad(data.shape);
+    index = recording ? tape.push_0(data) : untracked;
+}
+
+NoGradGuard::NoGradGuard() : previous(recording) { recording = false; }
+
+NoGradGuard::~NoGradGuard() { recording = previous; }
+
+bool grad_enabled() { return recording; }
+
+size_t tape_size() { return tape.size(); }
+
+void reset_tape(size_t n) { tape.truncate(n); }
+
+void reset_tape() { tape.truncate(tape.persistent); }
+
+void keep_tape() { tape.persistent = tape.size(); }
+
+void release_graph(const Var& first, const Var& last) {
+    if(first.index == untracked || last.index == untracked) {
+        throw std::logic_error("Var was computed without gradient recording");
+    }
+    if(first.index > last.index) throw std::invalid_argument("A graph must be released from its first node to its last");
+    tape.release(first.index, last.index);
+}
+
+void release_leaves(const std::forward_list<Var>& leaves, const double* first, const double* last) {
+    for(auto &leaf : leaves) {
+        auto index = leaf.index;
+        // A reset below the leaf dropped it from the kept nodes
+        if(index == untracked || index >= tape.persistent) continue;
+        auto &node = tape.nodes[index];
+        auto &grad = tape.grads[index];
+        if(node.type != OpType::leaf || node.shape != leaf.data.shape) continue;
+        if(!node.sparse) {
+            // Otherwise the node was reset away and bound by a newer owner
+            if(!grad.is_view() || grad.ptr() < first || grad.ptr() >= last) continue;
+            grad.bind(nullptr, Shape{});
+            node.has_grad = false;
+        }
+        tape.abandon(index);
+    }
+}
+
+void set_backward_threads(size_t n) {
+    if(n == 0) throw std::invalid_argument("The backward pass needs at least one thread");
+    // The calling thread takes part, so the pool only holds the extra ones
+    if(n == 1) pool.reset();
+    else if(!pool || pool->size() != n - 1) pool.reset(new WorkerPool(n - 1));
 }
 
-// Backpropagates using the chain rule along the leaf nodes
+size_t backward_threads() { return pool ? pool->size() + 1 : 1; }
+
+// Backpropagates using the chain rule along the leaf nodes, only visiting
+// nodes between the loss and the leaves that require gradients
 void Var::evaluate_leaves() const {
-    tape.grads[index].ones();
-    for(size_t i=index+1; i-- >0;){
-        auto &gradient = tape.grads[i];
-        auto &node = tape.nodes[i];
-        auto &g_shape = gradient.shape;
-        auto &w1_shape = node.weights[0].shape;
-        auto &w2_shape = node.weights[1].shape;
-        // Splits due to different multiplication methods
-        if(node.type == matmul){
-            tape.grads[node.parents[0]] += gradient * node.weights[0].t();
-            tape.grads[node.parents[1]] += node.weights[1].t() * gradient;
-
-        }
-        else if(node.type == scalar) {
-            if(w1_shape == g_shape) {
-                tape.grads[node.parents[0]] += gradient % node.weights[0];
-            }
-            if(w2_shape == g_shape) {
-                tape.grads[node.parents[1]] += gradient % node.weights[1];
-            }
+    if(index == untracked) throw std::logic_error("Var was computed without gradient recording");
+    if(!tape.requires_grad(index)) throw std::logic_error("Var does not depend on any leaf requiring gradients");
+    backward(index, nullptr, 0);
+}
+
+void Var::evaluate_leaves(const Tensor& seed) const {
+    if(index == untracked) throw std::logic_error("Var was computed without gradient recording");
+    if(!tape.requires_grad(index)) throw std::logic_error("Var does not depend on any leaf requiring gradients");
+    if(seed.shape != data.shape) throw std::invalid_argument("Seed gradients must match the shape of the Var");
+    backward(index, &seed, 0);
+}
+
+Tensor Var::grad() const {
+    if(index == untracked) throw std::logic_error("Var was computed without gradient recording");
+    auto &node = tape.nodes[index];
+    if(node.sparse) {
+        // Spread out into the whole table, optimisers read row_grad instead
+        Tensor dense(node.shape, 0);
+        for(size_t k=0; k<node.rows.rows.size(); ++k) {
+            std::copy(node.rows.values.begin() + k * node.rows.width, node.rows.values.begin() + (k + 1) * node.rows.width,
+                      dense.ptr() + node.rows.rows[k] * node.rows.width);
         }
-        else if(node.type == reduct) {
-            tape.grads[node.parents[0]] += gradient * node.weights[0];
+        return dense;
+    }
+    if(!node.has_grad) return Tensor(node.shape, 0);
+    return tape.grads[index];
+}
+
+const Tensor* Var::grad_view() const {
+    if(index == untracked) return nullptr;
+    auto &node = tape.nodes[index];
+    return node.has_grad && !node.sparse ? &tape.grads[index] : nullptr;
+}
+
+bool Var::requires_grad() const { return tape.requires_grad(index); }
+
+void Var::set_sparse_grad(bool sparse) {
+    if(index == untracked) throw std::logic_error("Var was computed without gradient recording");
+    auto &node = tape.nodes[index];
+    if(node.type != OpType::leaf) throw std::logic_error("Only leaf variables can take sparse gradients");
+    node.sparse = sparse;
+    node.has_grad = false;
+    node.rows.clear();
+    node.rows.width = data.shape[0];
+}
+
+void Var::bind_grad(double* memory) {
+    if(!memory) {
+        // Releasing is a no-op for a leaf that has since been truncated away
+        if(index < tape.size() && tape.grads[index].is_view()) {
+            tape.grads[index].bind(nullptr, Shape{});
+            tape.nodes[index].has_grad = false;
         }
-    } 
+        return;
+    }
+    if(index == untracked) throw std::logic_error("Var was computed without gradient recording");
+    auto &node = tape.nodes[index];
+    if(node.type != OpType::leaf || node.sparse) throw std::logic_error("Only dense leaf variables can bind their gradient");
+    tape.grads[index].bind(memory, node.shape);
+    node.has_grad = true;
+}
+
+void Var::set_grad_hook(const std::function<void()>& hook) {
+    if(index == untracked) throw std::logic_error("Var was computed without gradient recording");
+    auto &node = tape.nodes[index];
+    if(node.type != OpType::leaf) throw std::logic_error("Only leaf variables can take gradient hooks");
+    node.hook = hook;
+    tape.hooked = tape.hooked || static_cast<bool>(hook);
+}
+
+const RowGrad* Var::row_grad() const { return index == untracked ? nullptr : tape.rows(index); }
+RowGrad* Var::row_grad() { return index == untracked ? nullptr : tape.rows(index); }
+
+// Entries are appended the first time a row is touched and summed after
+void RowGrad::add(size_t row, const double* g, size_t stride) {
+    auto found = entries.find(row);
+    double* target;
+    if(found == entries.end()) {
+        entries.emplace(row, rows.size());
+        rows.push_back(row);
+        values.resize(values.size() + width, 0);
+        target = values.data() + values.size() - width;
+    }
+    else target = values.data() + found->second * width;
+    for(size_t d=0; d<width; ++d) target[d] += g[d * stride];
 }
 
-Tensor Var::grad() const { return tape.grads[index]; }
+void RowGrad::clear() {
+    rows.clear();
+    values.clear();
+    entries.clear();
+}
+
+void Var::set_tangent(const Tensor& tangent) {
+    if(tangent.shape != data.shape) throw std::invalid_argument("Tangents must match the shape of their Var");
+    dual = std::make_shared<const Tensor>(tangent);
+}
+
+Tensor Var::tangent() const { return dual ? *dual : Tensor(data.shape, 0); }
+
+void Var::set_requires_grad(bool requires) {
+    if(index == untracked) throw std::logic_error("Var was computed without gradient recording");
+    auto &node = tape.nodes[index];
+    if(node.type != OpType::leaf) throw std::logic_error("Only leaf variables can set requires_grad");
+    node.requires_grad = requires;
+}
 
 // Access operators
 double& Var::operator()(size_t x, size_t y, size_t z, size_t t) {
@@ -135,68 +1330,82 @@ double Var::operator()(size_t x, size_t y, size_t z, size_t t) const {
 std::ostream& operator<<(std::ostream& os, const Var& rhs) {
     os << "Tensor:" << std::endl;
     os << rhs.data;
-    os << "Gradient:" << std::endl;
-    os << tape.grads[rhs.index];
+    if(rhs.index != untracked && tape.nodes[rhs.index].has_grad) {
+        os << "Gradient:" << std::endl;
+        os << tape.grads[rhs.index];
+    }
     os << std::endl;
     return os;
 }
 
-// Differentiation works by assigning weights to the parent variables,
-// these weights are evaluated using standard differentiation methods
-// A new node is created on the tape with these weights and links to the
-// parent variables
-Var Var::operator+(const Var& y) const {
-    auto new_data = data + y.data;
-    auto x_weight = Tensor(data.shape, 1);
-    auto y_weight = Tensor(data.shape, 1);
-    auto new_index = tape.push_2(index, y.index, x_weight, y_weight, scalar);
-    tape.push_grad(new_data.shape);
-    return Var(new_data, new_index);
-}
+// Every operation is recorded as an op code and links to its parent
+// variables, the operands its derivative needs are kept alongside
+// and the vector-Jacobian product is only formed when backpropagating
+Var Var::record(OpType type, const Var& x, const Var* y, double scalar, const Var* z) {
+    auto &y_data = y ? y->data : no_operand;
+    auto &z_data = z ? z->data : no_operand;
+    auto new_data = apply(type, scalar, x.data, y_data, z_data);
+    auto index = untracked;
+    if(recording) {
+        array<size_t, 3> parents{{x.index, y ? y->index : untracked, z ? z->index : untracked}};
+        index = tape.push(type, parents, scalar, x.data, y_data, new_data);
+        const Var* operands[3] = {&x, y, z};
+        for(size_t k=0; k<3; ++k) {
+            if(operands[k] && parents[k] == untracked) tape.keep_constant(index, k, operands[k]->data);
+        }
+    }
+    Var result(new_data, index);
+    if(!x.dual && !(y && y->dual) && !(z && z->dual)) return result;
 
-Var Var::operator-(const Var& y) const {
-    auto new_data = data - y.data;
-    auto x_weight = Tensor(data.shape, 1);
-    auto y_weight = Tensor(data.shape, -1);
-    auto new_index = tape.push_2(index, y.index, x_weight, y_weight, scalar);
-    tape.push_grad(new_data.shape);
-    return Var(new_data, new_index);
+    // Forward mode, operands without a tangent contribute a zero one
+    auto tangent = [](const Var* operand) { return operand ? operand->tangent() : Tensor(); };
+    auto dx = x.tangent();
+    auto dy = tangent(y);
+    auto dz = tangent(z);
+    result.dual = std::make_shared<const Tensor>(jvp_op(type, scalar, x.data, y_data, new_data, dx, dy, dz));
+    if(index == untracked) return result;
+    // Kept for the forward mode backward pass of a Hessian-vector product
+    auto &node = tape.nodes[index];
+    if(!node.requires_grad) return result;
+    auto kept = saves(type);
+    if(kept & (save_x | save_out)) store(node.tangents[0], dx);
+    if(kept & save_y) store(node.tangents[1], dy);
+    node.has_tangents = true;
+    return result;
 }
 
-Var Var::operator%(const Var& y) const {
-    auto new_data = data % y.data;
-    auto x_weight = y.data; 
-    auto y_weight = data;
-    auto new_index = tape.push_2(index, y.index, x_weight, y_weight, scalar);
-    tape.push_grad(new_data.shape);
-    return Var(new_data, new_index);
-}
+// The sparse input is shared with the node instead of being kept in a
+// saved slot, and nothing else is needed as it takes no gradient. Being
+// linear in the weight, the node has no second order term to keep
+// tangents for.
+Var Var::record(const Var& weight, const nn::SparseTensor& x, const Var* bias) {
+    Tensor new_data(x.shape[0], weight.data.size / weight.data.shape[0]);
+    nn::matmul(weight.data, x, new_data);
+    if(bias) add_bias(new_data, bias->data);
+    auto index = untracked;
+    if(recording) {
+        array<size_t, 3> parents{{weight.index, untracked, bias ? bias->index : untracked}};
+        index = tape.push(OpType::sparse_linear, parents, 0, no_operand, no_operand, new_data);
+        auto &node = tape.nodes[index];
+        if(node.requires_grad) node.operand = std::make_shared<const nn::SparseTensor>(x);
+    }
+    Var result(new_data, index);
+    if(!weight.dual && !(bias && bias->dual)) return result;
 
-Var Var::operator/(const Var& y) const {
-    auto x_weight = 1.0 / y.data;
-    auto y_weight = 2.0 * data / (y.data % y.data);
-    auto new_data = data / y.data;
-    auto new_index = tape.push_2(index, y.index, x_weight, y_weight, scalar);
-    tape.push_grad(new_data.shape);
-    return Var(new_data, new_index);
+    Tensor tangent(new_data.shape, 0);
+    if(weight.dual) nn::matmul(*weight.dual, x, tangent);
+    if(bias && bias->dual) add_bias(tangent, *bias->dual);
+    result.dual = std::make_shared<const Tensor>(tangent);
+    return result;
 }
 
-Var Var::operator*(const Var& y) const {
-    auto x_weight = y.data;
-    auto y_weight = data;
-    auto new_data = data * y.data;
-    auto new_index = tape.push_2(index, y.index, x_weight, y_weight, matmul);
-    tape.push_grad(new_data.shape);
-    return Var(new_data, new_index);
-}
+Var Var::operator+(const Var& y) const { return record(OpType::add, *this, &y); }
+Var Var::operator-(const Var& y) const { return record(OpType::sub, *this, &y); }
+Var Var::operator%(const Var& y) const { return record(OpType::mul, *this, &y); }
+Var Var::operator/(const Var& y) const { return record(OpType::div, *this, &y); }
+Var Var::operator*(const Var& y) const { return record(OpType::matmul, *this, &y); }
 
-Var operator*(double x, const Var& y) {
-    auto weight = Tensor(y.data.shape, x);
-    auto new_data = x * y.data;
-    auto new_index = tape.push_1(y.index, weight);
-    tape.push_grad(new_data.shape);
-    return Var(new_data, new_index);
-}
+Var operator*(double x, const Var& y) { return Var::record(OpType::scale, y, nullptr, x); }
 
 void Var::operator=(const Tensor& y) { data = y; }
 
@@ -206,93 +1415,156 @@ void Var::operator/=(const Var& y){ *this = *this / y; }
 void Var::operator*=(const Var& y){ *this = *this * y; }
 void Var::operator%=(const Var& y){ *this = *this % y; }
 
-Var pow(const Var &x, double y) {
-    auto x_weight = y * nn::pow(x.data, y - 1);
-    auto new_index = tape.push_1(x.index, x_weight);
-    return Var(pow(x.data, y), new_index);
-}
-
-Var pow(const Var &x, const Var &y) {
-    auto x_weight = y.data % nn::pow(x.data, y.data-1);
-    auto pow_x_y = nn::pow(x.data,y.data);
-    auto y_weight = pow_x_y * nn::log(x.data);
-    auto new_index = tape.push_2(x.index, y.index, x_weight, y_weight, scalar);
-    return Var(pow_x_y, new_index);
-}
+Var pow(const Var &x, double y) { return Var::record(OpType::pow_const, x, nullptr, y); }
+Var pow(const Var &x, const Var &y) { return Var::record(OpType::pow, x, &y); }
 
 //var sqrt(const var &x) {
 //    auto new_index = tape.push_1(x.index, sqrt(x.data) * 0.5 );
 //    return var(sqrt(x.data), new_index);
 //}
 //
-//var exp(const var &x) {
-//    auto exp_x = tape.push_1(x.index, x.data * nn::exp(x.data));
-//    auto new_index = exp_x;
-//    return var(exp_x, new_index);
-//}
-//
-Var log(const Var &x) {
-    auto new_index = tape.push_1(x.index, 1 / x.data);
-    return Var(nn::log(x.data), new_index);
+Var exp(const Var &x) { return Var::record(OpType::exp, x); }
+Var tanh(const Var &x) { return Var::record(OpType::tanh, x); }
+Var sigmoid(const Var &x) { return Var::record(OpType::sigmoid, x); }
+Var relu(const Var &x) { return Var::record(OpType::relu, x); }
+Var gelu(const Var &x) { return Var::record(OpType::gelu, x); }
+Var softmax(const Var &x) { return Var::record(OpType::softmax, x); }
+Var log(const Var &x) { return Var::record(OpType::log, x); }
+Var sin(const Var &x) { return Var::record(OpType::sin, x); }
+Var cos(const Var &x) { return Var::record(OpType::cos, x); }
+Var tan(const Var &x) { return Var::record(OpType::tan, x); }
+Var asin(const Var &x) { return Var::record(OpType::asin, x); }
+Var acos(const Var &x) { return Var::record(OpType::acos, x); }
+Var atan(const Var &x) { return Var::record(OpType::atan, x); }
+
+Var Var::abs_sum() { return record(OpType::abs_sum, *this); }
+Var Var::sum() { return record(OpType::sum, *this); }
+
+Var conv_1d(const Var& x, const Var& y) { return Var::record(OpType::conv_1d, x, &y); }
+
+Var linear(const Var& weight, const Var& x, const Var& bias) {
+    return Var::record(OpType::linear, weight, &x, 0, &bias);
+}
+
+Var scale_shift(const Var& x, const Var& scale, const Var& shift) {
+    return Var::record(OpType::scale_shift, x, &scale, 0, &shift);
+}
+
+Var linear(const Var& weight, const nn::SparseTensor& x, const Var& bias) { return Var::record(weight, x, &bias); }
+Var operator*(const Var& weight, const nn::SparseTensor& x) { return Var::record(weight, x, nullptr); }
+
+Var batch_norm(const Var& x, const Var& gamma, const Var& beta, double eps) {
+    return Var::record(OpType::batch_norm, x, &gamma, eps, &beta);
 }
 
-Var sin(const Var &x) {
-    auto new_index = tape.push_1(x.index, nn::cos(x.data));
-    return Var(nn::sin(x.data), new_index);
+Var layer_norm(const Var& x, const Var& gamma, const Var& beta, double eps) {
+    return Var::record(OpType::layer_norm, x, &gamma, eps, &beta);
 }
 
-Var cos(const Var &x) {
-    auto new_index = tape.push_1(x.index, nn::sin(x.data) * -1.0);
-    return Var(nn::cos(x.data), new_index);
+Var lstm(const Var& proj, const Var& weight, size_t batch) {
+    return Var::record(OpType::lstm_seq, proj, &weight, static_cast<double>(batch));
 }
 
-Var tan(const Var &x) {
-    auto cos_x = nn::cos(x.data);
-    auto new_index = tape.push_1(x.index, 1.0 / (cos_x * cos_x));
-    return Var(nn::tan(x.data), new_index);
+Var gru(const Var& proj, const Var& weight, size_t batch) {
+    return Var::record(OpType::gru_seq, proj, &weight, static_cast<double>(batch));
 }
 
-Var asin(const Var &x) {
-    auto weight = 1.0 / nn::sqrt(1.0 - x.data * x.data);
-    auto new_index = tape.push_1(x.index, weight);
-    return Var(nn::asin(x.data), new_index);
+Var embedding(const Var& table, const Var& ids) {
+    return Var::record(OpType::embedding, table, &ids);
 }
 
-Var acos(const Var &x) {
-    auto new_index = tape.push_1(x.index, -1.0 / nn::sqrt(1.0 - x.data * x.data));
-    return Var(nn::acos(x.data), new_index);
+Var attention(const Var& qkv, size_t heads, bool causal) {
+    auto type = causal ? OpType::causal_attention : OpType::attention;
+    return Var::record(type, qkv, nullptr, static_cast<double>(heads));
 }
 
-Var atan(const Var &x) {
-    auto new_index = tape.push_1(x.index, 1.0 / (1.0 + x.data * x.data));
-    return Var(atan(x.data), new_index);
+Var cross_entropy(const Var& logits, const Var& labels) {
+    return Var::record(OpType::softmax_ce, logits, &labels);
 }
 
-Var Var::abs_sum() {
-    auto new_index = tape.push_1(index, Tensor(data.shape, 1), reduct);
-    auto double_new_data = data.abs_sum();
-    Tensor new_data(1);
-    new_data(0) = double_new_data;
-    tape.push_grad(new_data.shape);
-    return Var(new_data, new_index);
+// The segment runs once without recording, only its input is kept on the
+// tape. Backpropagating through the node records the segment again from
+// that input, runs the backward pass over just the new nodes and drops them.
+Var checkpoint(const Segment& segment, const Var& x) {
+    auto evaluated = [&]{
+        NoGradGuard no_grad;
+        return segment(x);
+    }();
+    auto &new_data = evaluated.data;
+    if(!recording) return evaluated;
+    auto new_index = tape.push(OpType::checkpoint, {{x.index, untracked, untracked}}, 0, x.data, no_operand, new_data);
+    tape.nodes[new_index].recompute = [segment](size_t i) {
+        EnableGrad enable_grad;
+        auto start = tape.size();
+        // Copied out since recording may reallocate the tape
+        auto seed = tape.grads[i];
+        auto x_index = tape.nodes[i].parents[0];
+        Var input(Tensor(tape.nodes[i].saved[0]));
+        input.set_requires_grad(tape.requires_grad(x_index));
+        auto output = segment(input);
+        if(output.requires_grad()) backward(output.index, &seed, start);
+        if(input.requires_grad()) tape.grad(x_index) += tape.grad(input.index);
+        tape.drop(start);
+    };
+    Var result(new_data, new_index);
+    // Forward mode already ran through the segment
+    result.dual = evaluated.dual;
+    return result;
 }
 
-Var Var::sum() {
-    auto new_index = tape.push_1(index, Tensor(data.shape, 1), reduct);
-    auto double_new_data = data.sum();
-    Tensor new_data(1);
-    new_data(0) = double_new_data;
-    tape.push_grad(new_data.shape);
-    return Var(new_data, new_index);
+Var jvp(const Segment& f, const Var& x, const Tensor& v) {
+    NoGradGuard no_grad;
+    Var input(x.data, untracked);
+    input.set_tangent(v);
+    return f(input);
 }
 
-Var conv_1d(const Var& x, const Var& y) {
-    auto new_data = nn::conv_1d(x.data, y.data);
-    auto x_weight = nn::conv_1d(Tensor(x.data.shape, 1), y.data);
-    auto y_weight = nn::conv_1d(x.data, Tensor(y.data.shape, 1));
-    auto new_index = tape.push_2(x.index, y.index, x_weight, y_weight, scalar);
-    tape.push_grad(new_data.shape);
-    return Var(new_data, new_index);
+// The tangent of every gradient is carried next to it, each node adds the
+// VJP of its gradient's tangent and the derivative of its own VJP along the
+// tangents of its operands. Nodes recorded before f are left untouched.
+Tensor hvp(const Segment& f, const Tensor& x, const Tensor& v) {
+    EnableGrad enable_grad;
+    auto start = tape.size();
+    DropGuard drop(start);
+    Var input(x);
+    input.set_requires_grad();
+    input.set_tangent(v);
+    auto output = f(input);
+    if(output.data.size != 1) throw std::invalid_argument("Hessian-vector products need a scalar function");
+    if(!output.requires_grad()) return Tensor(x.shape, 0);
+
+    auto index = output.index;
+    Pass pass;
+    auto &reached = tape.marks[pass.depth];
+    auto lowest = tape.mark(index, start, reached);
+    tape.grad(index).ones();
+    vector<Tensor> dots;
+    dots.reserve(index + 1 - start);
+    for(auto i=start; i<=index; ++i) {
+        dots.emplace_back(tape.nodes[i].shape, 0);
+    }
+    for(size_t i=index+1; i-- >lowest;) {
+        if(!reached[i]) continue;
+        auto &node = tape.nodes[i];
+        if(node.type == OpType::leaf) continue;
+        if(node.type == OpType::checkpoint) throw std::logic_error("Hessian-vector products can't run through checkpoints");
+        if(!second_order(node.type)) {
+            throw std::logic_error("Hessian-vector products can't run through normalisations, recurrences or attention");
+        }
+        array<Tensor*, 3> g{{nullptr, nullptr, nullptr}};
+        array<Tensor*, 3> d{{nullptr, nullptr, nullptr}};
+        for(size_t k=0; k<3; ++k) {
+            auto parent = node.parents[k];
+            if(!tape.requires_grad(parent) || parent < start) continue;
+            g[k] = &tape.grad(parent);
+            d[k] = &dots[parent - start];
+        }
+        auto in = tape.operands(node);
+        node_vjp(tape, node, tape.grads[i], g[0], g[1], g[2]);
+        node_vjp(tape, node, dots[i - start], d[0], d[1], d[2]);
+        if(node.has_tangents) vjp_dot(node.type, node.scalar, tape.grads[i], in, tape.tangents(node), d[0], d[1]);
+    }
+    return dots[input.index - start];
 }
 
 //var conv2d(const Var& x, const Var& weight, size_t stride, size_t kernel) {
@@ -6,17 +6,31 @@
 #ifndef AUTODIFF_H
 #define AUTODIFF_H
 
+#include "sparse.hpp"
 #include "tensor.hpp"
 
+#include <forward_list>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
 namespace autodiff {
  
 // Forward declarations   
 class Var;
+enum class OpType;
     
 Var pow(const Var&, double);
 Var pow(const Var&, const Var&);
 Var sqrt(const Var&);
 Var exp(const Var&);
+// Activations, softmax normalises each column
+Var tanh(const Var&);
+Var sigmoid(const Var&);
+Var relu(const Var&);
+Var gelu(const Var&);
+Var softmax(const Var&);
 Var log(const Var&);
 Var sin(const Var&);
 Var cos(const Var&);
@@ -25,14 +39,135 @@ Var asin(const Var&);
 Var acos(const Var&);
 Var atan(const Var&);
 Var conv_1d(const Var&, const Var&);
+// weight * x + bias as a single operation, the bias is added to every column of the product
+Var linear(const Var&, const Var&, const Var&);
+// The same with a sparse input, costing time in proportion to its entries.
+// The input is a constant, only the weight and bias get gradients.
+Var linear(const Var&, const nn::SparseTensor&, const Var&);
+Var operator*(const Var&, const nn::SparseTensor&);
+// Mean over the columns of -log softmax(logits)[label] as a single operation,
+// labels hold the class index of each column
+Var cross_entropy(const Var&, const Var&);
+// gamma * (x - mean) / sqrt(var + eps) + beta, with the statistics taken over
+// each row for batch norm and each column for layer norm. gamma and beta
+// hold one value per row.
+Var batch_norm(const Var&, const Var&, const Var&, double);
+Var layer_norm(const Var&, const Var&, const Var&, double);
+// Recurrences over the input projection of a whole sequence, timestep t of
+// sample b in column t * batch + b, returning every hidden state in the
+// same layout. The projection stacks the LSTM input, forget, cell and output
+// gates, or the GRU reset, update and new gates. A GRU weight has one extra
+// column for the recurrent bias.
+Var lstm(const Var&, const Var&, size_t);
+Var gru(const Var&, const Var&, size_t);
+// Multi-head self-attention over a sequence with one column per token, the
+// rows stack the queries, keys and values. The causal form only lets each
+// token attend to itself and the tokens before it.
+Var attention(const Var&, size_t, bool=false);
+// Looks up the rows of a table picked by ids, one id per column, returning
+// each row as a column. A table set to take sparse gradients only
+// accumulates the rows that were looked up.
+Var embedding(const Var&, const Var&);
+// x * scale + shift with one scale and one shift per row, applied to every column
+Var scale_shift(const Var&, const Var&, const Var&);
 Var conv_2d(const Var&, const Var&, size_t, size_t);
 
+// A section of a forward pass taking and returning one variable
+typedef std::function<Var(const Var&)> Segment;
+
+// Runs a segment keeping only its input and output on the tape, the
+// interior is recomputed when backpropagating. Trades compute for memory.
+// Segments should only close over parameters, not other recorded Vars.
+Var checkpoint(const Segment&, const Var&);
+
+// Jacobian-vector product of f at x along v, computed in one forward pass
+// without recording. The result holds f(x) with J v as its tangent.
+Var jvp(const Segment&, const Var&, const nn::Tensor&);
+
+// Hessian-vector product of a scalar f at x along v, by running the
+// backward pass in forward mode over a recording of f with x tangent to v
+nn::Tensor hvp(const Segment&, const nn::Tensor&, const nn::Tensor&);
+
+/**
+    RowGrad
+    Gradient of a table that is zero outside the rows it lists, row rows[k]
+    of the gradient is held in values from k * width. Each row appears once.
+*/
+struct RowGrad {
+    size_t width = 0;
+    std::vector<size_t> rows;
+    std::vector<double> values;
+
+    // Adds a strided row of width values to the gradient of a table row
+    void add(size_t, const double*, size_t);
+    void clear();
+private:
+    // Entry of each row in rows
+    std::unordered_map<size_t, size_t> entries;
+};
+
+/**
+    NoGradGuard
+    Disables tape recording for its lifetime, Var operations only compute
+    their data. Intended for inference where no gradients are needed.
+*/
+class NoGradGuard {
+    bool previous;
+public:
+    NoGradGuard();
+    ~NoGradGuard();
+    NoGradGuard(const NoGradGuard&) = delete;
+    void operator=(const NoGradGuard&) = delete;
+};
+
+// Whether Var operations are currently recorded on the tape
+bool grad_enabled();
+
+// Number of nodes currently recorded on the tape
+size_t tape_size();
+
+// Number of threads the backward pass of the calling thread runs on,
+// independent branches and the gradients of each parent of a node are
+// computed concurrently when above 1. Gradients shared between branches are
+// summed in whichever order they finish.
+void set_backward_threads(size_t);
+size_t backward_threads();
+
+// Truncates the tape to its first n nodes and zeroes their gradients
+// Vars recorded after n are invalidated, their buffers are recycled
+void reset_tape(size_t);
+// Truncates the tape back to the nodes kept by keep_tape
+void reset_tape();
+// Keeps every node now on the tape through later resets. Nets call it as
+// they create parameters, so one net's zero_grad spares the others, and
+// give them back with release_leaves when destroyed.
+void keep_tape();
+// Frees what the tape keeps for the nodes recorded from first to last, for
+// a graph whose backward pass is done while later graphs still need theirs.
+// The nodes stay on the tape, holding nothing, until it is reset.
+void release_graph(const Var&, const Var&);
+// Gives back kept leaves whose owner is going away, releasing gradients
+// bound to memory from first to last. Leaves whose node a reset has since
+// handed to someone else are left alone. The kept part of the tape shrinks
+// once nothing still kept lies above what was given back.
+void release_leaves(const std::forward_list<Var>&, const double* first, const double* last);
+
 /**
     Var
-    An automatically differentiable variable
+    An automatically differentiable variable, recorded on the tape of the
+    thread that created it. Each thread has its own tape, recording switch
+    and backward threads, so Vars should only be used on their own thread,
+    or anywhere under a NoGradGuard.
 */
 class Var {
     size_t index;
+    // Directional derivative carried through forward mode, null if zero
+    std::shared_ptr<const nn::Tensor> dual;
+
+    // Computes an operation and records it on the tape
+    static Var record(OpType, const Var&, const Var* =nullptr, double=0, const Var* =nullptr);
+    // Records weight * x + bias for a sparse x, the bias may be null
+    static Var record(const Var&, const nn::SparseTensor&, const Var*);
 
 public:
     nn::Tensor data;
@@ -48,10 +183,48 @@ public:
    
     // Evaluate the gradient of all nodes of the tape with respect to self
     void evaluate_leaves() const;
+    // Backpropagates a gradient of self from further on, such as from the
+    // next stage of a pipeline, in place of ones
+    void evaluate_leaves(const nn::Tensor&) const;
 
     // Returns the last evaluated gradient
     nn::Tensor grad() const;
 
+    // The gradient held on the tape without copying it, null if no backward
+    // pass has reached the Var or its gradient is sparse
+    const nn::Tensor* grad_view() const;
+
+    // Whether gradients flow back to this variable, leaves default to false
+    bool requires_grad() const;
+
+    // Marks a leaf as needing its gradient evaluated
+    void set_requires_grad(bool=true);
+
+    // Gives a table leaf a row-sparse gradient, only embedding lookups may read it
+    void set_sparse_grad(bool=true);
+
+    // Keeps the gradient of a dense leaf in memory owned elsewhere, one value
+    // per element, which is taken as the current gradient and must outlive
+    // the leaf or be released by binding null. Lets many parameters share
+    // one gradient buffer.
+    void bind_grad(double*);
+
+    // Called by each backward pass reaching a leaf once its gradient is
+    // complete, while the pass carries on with the rest of the tape. May run
+    // on a backward worker thread.
+    void set_grad_hook(const std::function<void()>&);
+
+    // Rows of the gradient of a sparse leaf, null for dense ones
+    const RowGrad* row_grad() const;
+    RowGrad* row_grad();
+
+    // Seeds forward mode, operations on the Var propagate the tangent to their results
+    void set_tangent(const nn::Tensor&);
+
+    // Tangent propagated to this Var, zero if none reached it
+    nn::Tensor tangent() const;
+    bool has_tangent() const { return static_cast<bool>(dual); }
+
     // Element access using a zero index
     double& operator()(size_t, size_t=0, size_t=0, size_t=0);
 
@@ -90,6 +263,11 @@ public:
     friend Var pow(const Var&, const Var&);
     friend Var sqrt(const Var&);
     friend Var exp(const Var&);
+    friend Var tanh(const Var&);
+    friend Var sigmoid(const Var&);
+    friend Var relu(const Var&);
+    friend Var gelu(const Var&);
+    friend Var softmax(const Var&);
     friend Var log(const Var&);
     friend Var sin(const Var&);
     friend Var cos(const Var&);
@@ -99,6 +277,23 @@ public:
     friend Var atan(const Var&);
     friend Var conv_1d(const Var&, const Var&);
     friend Var conv_2d(const Var&, const Var&, size_t, size_t);
+    friend Var linear(const Var&, const Var&, const Var&);
+    friend Var linear(const Var&, const nn::SparseTensor&, const Var&);
+    friend Var operator*(const Var&, const nn::SparseTensor&);
+    friend Var cross_entropy(const Var&, const Var&);
+    friend Var batch_norm(const Var&, const Var&, const Var&, double);
+    friend Var layer_norm(const Var&, const Var&, const Var&, double);
+    friend Var lstm(const Var&, const Var&, size_t);
+    friend Var gru(const Var&, const Var&, size_t);
+    friend Var attention(const Var&, size_t, bool);
+    friend Var embedding(const Var&, const Var&);
+    friend Var scale_shift(const Var&, const Var&, const Var&);
+    friend Var checkpoint(const Segment&, const Var&);
+    friend void release_graph(const Var&, const Var&);
+    friend void release_leaves(const std::forward_list<Var>&, const double*, const double*);
+    friend Var jvp(const Segment&, const Var&, const nn::Tensor&);
+    friend nn::Tensor hvp(const Segment&, const nn::Tensor&, const nn::Tensor&);
+    friend class Graph;
 
     // Initialisation with a normal distibution
     void randn(int mean=0, int var=1) { data.randn(mean, var); }
@@ -0,0 +1,263 @@
+#include "checkpointer.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nn {
+
+static const char magic[8] = {'N', 'N', 'C', 'H', 'E', 'C', 'K', 'P'};
+
+static const std::string prefix = "checkpoint-", suffix = ".nn", partial = ".tmp";
+
+/**
+    Header
+    Starts a checkpoint file, followed by the values of the parameters, then
+    those of the optimiser buffers and finally its counters
+*/
+struct Header {
+    char magic[8];
+    std::uint64_t step, params, values, counters;
+};
+
+static std::runtime_error system_error(const std::string& what) {
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+// Visits the values of the dense parameters as their arena, then every sparse table
+template<typename Visit>
+static void visit_parameters(Net& net, Visit visit) {
+    auto flat = net.flat_params();
+    visit(flat.ptr(), flat.size);
+    for(auto &parameter : net.params()) {
+        if(parameter.row_grad()) visit(parameter.data.ptr(), parameter.data.size);
+    }
+}
+
+template<typename Visit>
+static void visit_state(const opt::Opt::State& state, Visit visit) {
+    for(auto buffer : state.buffers) visit(buffer->ptr(), buffer->size);
+}
+
+// Writes every byte, carrying on after partial writes and interruptions
+static bool write_all(int fd, const void* data, size_t size) {
+    auto bytes = static_cast<const char*>(data);
+    while(size) {
+        auto written = ::write(fd, bytes, size);
+        if(written < 0 && errno == EINTR) continue;
+        if(written <= 0) return false;
+        bytes += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+// Step of a checkpoint file name, false for any other file
+static bool parse(const std::string& name, const std::string& ending, size_t& step) {
+    if(name.size() <= prefix.size() + ending.size() || name.compare(0, prefix.size(), prefix)
+       || name.compare(name.size() - ending.size(), ending.size(), ending)) return false;
+    auto digits = name.substr(prefix.size(), name.size() - prefix.size() - ending.size());
+    if(digits.find_first_not_of("0123456789") != std::string::npos) return false;
+    step = std::stoull(digits);
+    return true;
+}
+
+Checkpointer::Checkpointer(const std::string& directory_, size_t keep_) : directory(directory_), keep(keep_) {
+    if(keep == 0) throw std::invalid_argument("A checkpointer needs to keep at least one checkpoint");
+    if(::mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) throw system_error("Could not create " + directory);
+    auto listing = ::opendir(directory.c_str());
+    if(!listing) throw system_error("Could not read " + directory);
+    while(auto entry = ::readdir(listing)) {
+        std::string name = entry->d_name;
+        size_t step;
+        if(parse(name, suffix, step)) steps.push_back(step);
+        // Left behind by a run that stopped part way through writing
+        else if(parse(name, suffix + partial, step)) ::unlink((directory + "/" + name).c_str());
+    }
+    ::closedir(listing);
+    std::sort(steps.begin(), steps.end());
+    worker = std::thread([this]{ work(); });
+}
+
+Checkpointer::~Checkpointer() {
+    {
+        std::lock_guard<std::mutex> held(lock);
+        stopping = true;
+        changed.notify_all();
+    }
+    worker.join();
+}
+
+std::string Checkpointer::path(size_t step) const {
+    return directory + "/" + prefix + std::to_string(step) + suffix;
+}
+
+std::string Checkpointer::latest() {
+    std::lock_guard<std::mutex> held(lock);
+    return steps.empty() ? std::string() : path(steps.back());
+}
+
+// The snapshot is filled without the lock, the writer never touches a
+// buffer that is neither pending nor being written
+void Checkpointer::save(Net& net, opt::Opt* optimiser, size_t step) {
+    std::unique_lock<std::mutex> held(lock);
+    changed.wait(held, [&]{ return error || pending < 0; });
+    if(error) {
+        auto first = error;
+        error = nullptr;
+        std::rethrow_exception(first);
+    }
+    auto next = writing == 0 ? 1 : 0;
+    held.unlock();
+
+    auto &snapshot = snapshots[next];
+    auto state = optimiser ? optimiser->state() : opt::Opt::State();
+    size_t params = 0, total = 0;
+    visit_parameters(net, [&](const double*, size_t n){ params += n; });
+    visit_state(state, [&](const double*, size_t n){ total += n; });
+    // Resizing to the same size keeps the buffer, so only the first save allocates
+    snapshot.values.resize(params + total);
+    auto out = snapshot.values.data();
+    auto copy = [&](const double* values, size_t n){
+        if(n) std::memcpy(out, values, n * sizeof(double));
+        out += n;
+    };
+    visit_parameters(net, copy);
+    visit_state(state, copy);
+    snapshot.counters.clear();
+    for(auto &run : state.counters) snapshot.counters.insert(snapshot.counters.end(), run.first, run.first + run.second);
+    snapshot.params = params;
+    snapshot.step = step;
+
+    held.lock();
+    pending = next;
+    changed.notify_all();
+}
+
+void Checkpointer::flush() {
+    std::unique_lock<std::mutex> held(lock);
+    changed.wait(held, [&]{ return error || (pending < 0 && writing < 0); });
+    if(error) {
+        auto first = error;
+        error = nullptr;
+        std::rethrow_exception(first);
+    }
+}
+
+// Drains the pending snapshot before stopping
+void Checkpointer::work() {
+    std::unique_lock<std::mutex> held(lock);
+    while(true) {
+        changed.wait(held, [&]{ return stopping || pending >= 0; });
+        if(pending < 0) return;
+        writing = pending;
+        pending = -1;
+        changed.notify_all();
+        held.unlock();
+        std::exception_ptr failure;
+        try {
+            write(snapshots[writing]);
+        }
+        catch(...) {
+            failure = std::current_exception();
+        }
+        held.lock();
+        if(failure && !error) error = failure;
+        writing = -1;
+        changed.notify_all();
+    }
+}
+
+// The checkpoint only takes its final name once its contents are synced,
+// and the rename is synced through the directory before older ones go
+void Checkpointer::write(const Snapshot& snapshot) {
+    auto target = path(snapshot.step), temporary = target + partial;
+    auto fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) throw system_error("Could not create " + temporary);
+    Header header;
+    std::memcpy(header.magic, magic, sizeof(magic));
+    header.step = snapshot.step;
+    header.params = snapshot.params;
+    header.values = snapshot.values.size();
+    header.counters = snapshot.counters.size();
+    auto written = write_all(fd, &header, sizeof(header))
+                   && write_all(fd, snapshot.values.data(), snapshot.values.size() * sizeof(double))
+                   && write_all(fd, snapshot.counters.data(), snapshot.counters.size() * sizeof(std::uint64_t))
+                   && ::fsync(fd) == 0;
+    auto failure = system_error("Could not write " + temporary);
+    ::close(fd);
+    if(!written) {
+        ::unlink(temporary.c_str());
+        throw failure;
+    }
+    if(::rename(temporary.c_str(), target.c_str()) != 0) {
+        failure = system_error("Could not rename " + temporary);
+        ::unlink(temporary.c_str());
+        throw failure;
+    }
+    auto dir = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if(dir >= 0) {
+        ::fsync(dir);
+        ::close(dir);
+    }
+
+    std::vector<size_t> expired;
+    {
+        std::lock_guard<std::mutex> held(lock);
+        auto at = std::lower_bound(steps.begin(), steps.end(), snapshot.step);
+        if(at == steps.end() || *at != snapshot.step) steps.insert(at, snapshot.step);
+        if(steps.size() > keep) {
+            expired.assign(steps.begin(), steps.end() - static_cast<std::ptrdiff_t>(keep));
+            steps.erase(steps.begin(), steps.end() - static_cast<std::ptrdiff_t>(keep));
+        }
+    }
+    for(auto step : expired) ::unlink(path(step).c_str());
+}
+
+// The whole file is read and checked before anything is restored, so a
+// failed load leaves the net and optimiser as they were
+size_t Checkpointer::load(const std::string& file, Net& net, opt::Opt* optimiser) {
+    std::ifstream in(file, std::ios::binary);
+    if(!in) throw std::runtime_error("Could not open " + file);
+    Header header;
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if(!in || std::memcmp(header.magic, magic, sizeof(magic))) throw std::invalid_argument(file + " is not a checkpoint");
+
+    auto state = optimiser ? optimiser->state() : opt::Opt::State();
+    size_t params = 0, total = 0, counters = 0;
+    visit_parameters(net, [&](const double*, size_t n){ params += n; });
+    visit_state(state, [&](const double*, size_t n){ total += n; });
+    for(auto &run : state.counters) counters += run.second;
+    if(header.params != params || (optimiser && (header.values != params + total || header.counters != counters))) {
+        throw std::invalid_argument(file + " was saved from a different model or optimiser");
+    }
+
+    std::vector<double> values(header.values);
+    std::vector<std::uint64_t> steps(header.counters);
+    in.read(reinterpret_cast<char*>(values.data()), static_cast<std::streamsize>(values.size() * sizeof(double)));
+    in.read(reinterpret_cast<char*>(steps.data()), static_cast<std::streamsize>(steps.size() * sizeof(std::uint64_t)));
+    if(!in) throw std::invalid_argument(file + " is shorter than its header says");
+
+    auto from = values.data();
+    auto copy = [&](double* out, size_t n){
+        if(n) std::memcpy(out, from, n * sizeof(double));
+        from += n;
+    };
+    visit_parameters(net, copy);
+    visit_state(state, copy);
+    auto count = steps.begin();
+    for(auto &run : state.counters) {
+        std::copy(count, count + static_cast<std::ptrdiff_t>(run.second), run.first);
+        count += static_cast<std::ptrdiff_t>(run.second);
+    }
+    return static_cast<size_t>(header.step);
+}
+
+} // namespace nn
@@ -0,0 +1,84 @@
+/**
+    Checkpointer
+    Saves the parameters of a net and the state of its optimiser to disk
+    without holding up training
+ */
+
+#ifndef CHECKPOINTER_H
+#define CHECKPOINTER_H
+
+#include "net.hpp"
+#include "optim.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace nn {
+
+/**
+    Checkpointer
+    Keeps the newest checkpoints of a training run in a directory, named
+    checkpoint-<step>.nn. Saving only copies the parameters and optimiser
+    state into one of two reused snapshot buffers, a background thread then
+    writes it to a temporary file, syncs it and renames it into place, so a
+    checkpoint on disk is always complete. Once it is, the oldest
+    checkpoints beyond the number kept are deleted, including any left in
+    the directory by an earlier run.
+*/
+class Checkpointer {
+public:
+    Checkpointer(const std::string&, size_t keep=3);
+    // Waits for the checkpoints already saved to be written
+    ~Checkpointer();
+    Checkpointer(const Checkpointer&) = delete;
+    Checkpointer& operator=(const Checkpointer&) = delete;
+
+    // Snapshots a net and optionally its optimiser at a step, returning as
+    // soon as the copy is made. Only waits if the snapshot before it is still
+    // queued behind one being written. Should be called from one thread,
+    // rethrows the first error writing an earlier checkpoint.
+    void save(Net&, opt::Opt*, size_t);
+
+    // Waits until every checkpoint saved so far is on disk
+    void flush();
+
+    // Path of the newest checkpoint in the directory, empty if there is none
+    std::string latest();
+
+    // Restores a net and optionally its optimiser from a checkpoint of the
+    // same model, returning the step it was saved at
+    static size_t load(const std::string&, Net&, opt::Opt*);
+
+private:
+    struct Snapshot {
+        std::vector<double> values;
+        std::vector<std::uint64_t> counters;
+        // Values belonging to the parameters, the rest are optimiser state
+        size_t params = 0, step = 0;
+    };
+
+    void work();
+    void write(const Snapshot&);
+    std::string path(size_t) const;
+
+    std::string directory;
+    size_t keep;
+    // Steps of the checkpoints on disk, oldest first
+    std::vector<size_t> steps;
+    Snapshot snapshots[2];
+    // Snapshot waiting to be written and the one being written, -1 for none
+    int pending = -1, writing = -1;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::exception_ptr error;
+    bool stopping = false;
+    std::thread worker;
+};
+
+} // namespace nn
+#endif // CHECKPOINTER_H
@@ -0,0 +1,322 @@
+#include "dataset.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace dataset {
+
+static const char magic[8] = {'N', 'N', 'R', 'E', 'C', 'O', 'R', 'D'};
+
+// Doubles per cache line
+static const size_t line = 64 / sizeof(double);
+
+// Samples gathered together, so each row of a batch is written a line at a time
+static const size_t group = line;
+
+static std::runtime_error system_error(const std::string& what) {
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+// Bytes of one stored value
+static size_t width(Type type) {
+    switch(type) {
+        case Type::f64: return sizeof(double);
+        case Type::f32: return sizeof(float);
+        case Type::u8: return 1;
+    }
+    throw std::invalid_argument("Unknown field type");
+}
+
+// Records start after the magic, the record and field counts and a count
+// and type per field, rounded up to a 64 byte boundary
+static size_t data_offset(size_t fields) {
+    return (sizeof(magic) + 2 * sizeof(std::uint64_t) + 2 * sizeof(std::uint64_t) * fields + 63) / 64 * 64;
+}
+
+Writer::Writer(const std::string& path, const std::vector<Field>& fields_) : fields(fields_) {
+    if(fields.empty()) throw std::invalid_argument("Records need at least one field");
+    size_t bytes = 0;
+    for(auto &field : fields) bytes += field.count * width(field.type);
+    if(bytes == 0) throw std::invalid_argument("Records need at least one value");
+    record.resize(bytes);
+    file = std::fopen(path.c_str(), "wb");
+    if(!file) throw system_error("Could not create " + path);
+    std::vector<unsigned char> header(data_offset(fields.size()), 0);
+    auto put = [&](size_t at, std::uint64_t value){ std::memcpy(header.data() + at, &value, sizeof(value)); };
+    std::memcpy(header.data(), magic, sizeof(magic));
+    put(16, fields.size());
+    for(size_t f=0; f<fields.size(); ++f) {
+        put(24 + 16 * f, fields[f].count);
+        put(32 + 16 * f, static_cast<std::uint64_t>(fields[f].type));
+    }
+    if(std::fwrite(header.data(), 1, header.size(), file) != header.size()) {
+        std::fclose(file);
+        throw system_error("Could not write " + path);
+    }
+}
+
+Writer::~Writer() {
+    try {
+        close();
+    }
+    catch(...) {}
+}
+
+void Writer::append(const std::vector<const nn::Tensor*>& tensors) {
+    if(!file) throw std::logic_error("Appended to a closed record file");
+    if(tensors.size() != fields.size()) throw std::invalid_argument("Records need one tensor per field");
+    auto n = tensors[0]->shape[0];
+    for(size_t f=0; f<fields.size(); ++f) {
+        if(tensors[f]->shape[0] != n || tensors[f]->size != n * fields[f].count) {
+            throw std::invalid_argument("Each tensor needs a column per record and a row per value of its field");
+        }
+    }
+    for(size_t b=0; b<n; ++b) {
+        auto out = record.data();
+        for(size_t f=0; f<fields.size(); ++f) {
+            auto values = tensors[f]->ptr();
+            for(size_t e=0; e<fields[f].count; ++e) {
+                auto value = values[e * n + b];
+                switch(fields[f].type) {
+                    case Type::f64:
+                        std::memcpy(out, &value, sizeof(value));
+                        break;
+                    case Type::f32: {
+                        auto single = static_cast<float>(value);
+                        std::memcpy(out, &single, sizeof(single));
+                        break;
+                    }
+                    case Type::u8:
+                        if(!(value >= 0 && value <= 255)) throw std::invalid_argument("Byte fields only hold values from 0 to 255");
+                        *out = static_cast<unsigned char>(std::lround(value));
+                        break;
+                }
+                out += width(fields[f].type);
+            }
+        }
+        if(std::fwrite(record.data(), 1, record.size(), file) != record.size()) throw system_error("Could not write a record");
+        ++records;
+    }
+}
+
+void Writer::close() {
+    if(!file) return;
+    auto closing = file;
+    file = nullptr;
+    std::uint64_t count = records;
+    auto written = std::fseek(closing, sizeof(magic), SEEK_SET) == 0 && std::fwrite(&count, sizeof(count), 1, closing) == 1;
+    if(std::fclose(closing) != 0 || !written) throw system_error("Could not finish a record file");
+}
+
+File::File(const std::string& path) {
+    auto fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) throw system_error("Could not open " + path);
+    struct stat info;
+    if(::fstat(fd, &info) < 0) {
+        ::close(fd);
+        throw system_error("Could not read " + path);
+    }
+    length = static_cast<size_t>(info.st_size);
+    if(length < data_offset(0)) {
+        ::close(fd);
+        throw std::invalid_argument(path + " is not a record file");
+    }
+    map = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(map == MAP_FAILED) throw system_error("Could not map " + path);
+    auto bytes = static_cast<const unsigned char*>(map);
+    auto get = [&](size_t at){ std::uint64_t value; std::memcpy(&value, bytes + at, sizeof(value)); return value; };
+    try {
+        auto count = get(16);
+        if(std::memcmp(bytes, magic, sizeof(magic)) || count == 0 || count > (length - 24) / 16) {
+            throw std::invalid_argument(path + " is not a record file");
+        }
+        stride = 0;
+        for(size_t f=0; f<count; ++f) {
+            auto type = get(32 + 16 * f);
+            if(type > static_cast<std::uint64_t>(Type::u8)) throw std::invalid_argument(path + " holds an unknown field type");
+            layout.push_back(Field{static_cast<size_t>(get(24 + 16 * f)), static_cast<Type>(type)});
+            offsets.push_back(stride);
+            stride += layout.back().count * width(layout.back().type);
+        }
+        records = get(sizeof(magic));
+        auto offset = data_offset(count);
+        if(stride == 0 || offset > length || records > (length - offset) / stride) {
+            throw std::invalid_argument(path + " is shorter than its header says");
+        }
+        start = bytes + offset;
+    }
+    catch(...) {
+        ::munmap(map, length);
+        throw;
+    }
+}
+
+File::~File() {
+    ::munmap(map, length);
+}
+
+void File::advise(bool sequential) const {
+    ::posix_madvise(map, length, sequential ? POSIX_MADV_SEQUENTIAL : POSIX_MADV_RANDOM);
+}
+
+// Converts count values of each record to doubles, record b in column b
+template<typename T>
+static void scatter(const unsigned char* const* sources, size_t first, size_t last, size_t count, size_t n, double* out) {
+    for(size_t e=0; e<count; ++e) {
+        for(size_t b=first; b<last; ++b) {
+            T value;
+            std::memcpy(&value, sources[b - first] + e * sizeof(T), sizeof(T));
+            out[e * n + b] = static_cast<double>(value);
+        }
+    }
+}
+
+void File::gather(size_t f, const size_t* indices, size_t n, nn::Tensor& out) const {
+    if(f >= layout.size()) throw std::invalid_argument("Record files only hold " + std::to_string(layout.size()) + " fields");
+    auto count = layout[f].count;
+    if(out.shape[0] != n || out.size != n * count) {
+        throw std::invalid_argument("Gathering needs a column per record and a row per value of the field");
+    }
+    const unsigned char* sources[group];
+    for(size_t b0=0; b0<n; b0+=group) {
+        auto b1 = std::min(n, b0 + group);
+        for(size_t b=b0; b<b1; ++b) {
+            if(indices[b] >= records) throw std::invalid_argument("Record index out of range");
+            sources[b - b0] = start + indices[b] * stride + offsets[f];
+        }
+        switch(layout[f].type) {
+            case Type::f64: scatter<double>(sources, b0, b1, count, n, out.ptr()); break;
+            case Type::f32: scatter<float>(sources, b0, b1, count, n, out.ptr()); break;
+            case Type::u8: scatter<unsigned char>(sources, b0, b1, count, n, out.ptr()); break;
+        }
+    }
+}
+
+Loader::Loader(const File& file_, size_t batch, size_t threads, size_t depth, bool shuffle_, std::uint64_t seed_,
+               bool drop_last)
+: file(file_), batch_size(batch), shuffle(shuffle_), seed(seed_), slots(depth) {
+    if(batch == 0 || threads == 0 || depth == 0) {
+        throw std::invalid_argument("Loaders need a batch of at least one record, a thread and a buffer");
+    }
+    per_epoch = drop_last ? file.size() / batch : (file.size() + batch - 1) / batch;
+    if(per_epoch == 0) throw std::invalid_argument("Dataset holds fewer records than a batch");
+    file.advise(!shuffle);
+    // Every field gets its own lines, sized for a full batch
+    size_t length = 0;
+    for(auto &field : file.fields()) length += (batch * field.count + line - 1) / line * line;
+    for(auto &slot : slots) {
+        slot.memory.reset(new double[length + line]());
+        auto offset = reinterpret_cast<std::uintptr_t>(slot.memory.get()) / sizeof(double) % line;
+        slot.start = slot.memory.get() + (offset ? line - offset : 0);
+        slot.length = length;
+        slot.batch.fields.resize(file.fields().size());
+        // Keeping the buffers resident is only a hint, it needs privileges or a raised limit
+        ::mlock(slot.start, length * sizeof(double));
+    }
+    for(size_t t=0; t<threads; ++t) workers.emplace_back([this]{ work(); });
+}
+
+Loader::~Loader() {
+    {
+        std::lock_guard<std::mutex> held(lock);
+        stopping = true;
+        changed.notify_all();
+    }
+    for(auto &worker : workers) worker.join();
+    for(auto &slot : slots) ::munlock(slot.start, slot.length * sizeof(double));
+}
+
+const Loader::Batch* Loader::next() {
+    std::unique_lock<std::mutex> held(lock);
+    // The batch handed out last is finished with, so its slot can be refilled
+    if(returned < delivered) {
+        slots[returned % slots.size()].ready = false;
+        ++returned;
+        changed.notify_all();
+    }
+    if(delivered && delivered % per_epoch == 0 && !ended) {
+        ended = true;
+        return nullptr;
+    }
+    ended = false;
+    auto &slot = slots[delivered % slots.size()];
+    changed.wait(held, [&]{ return error || (slot.ready && slot.sequence == delivered); });
+    if(error) std::rethrow_exception(error);
+    ++delivered;
+    // Every batch of the epochs before this one has been filled
+    while(first_epoch < (delivered - 1) / per_epoch) {
+        orders.pop_front();
+        ++first_epoch;
+    }
+    return &slot.batch;
+}
+
+// Called with the lock held. A deque keeps the orders in place as later
+// epochs are added, so workers can read them after letting go of the lock.
+const std::vector<size_t>& Loader::order(size_t epoch) {
+    while(first_epoch + orders.size() <= epoch) {
+        std::vector<size_t> records(file.size());
+        for(size_t r=0; r<records.size(); ++r) records[r] = r;
+        if(shuffle) {
+            // Seeded per epoch so the order doesn't depend on which worker asks first
+            std::mt19937_64 random(seed + first_epoch + orders.size());
+            for(size_t r=records.size(); r-- >1;) std::swap(records[r], records[random() % (r + 1)]);
+        }
+        orders.push_back(std::move(records));
+    }
+    return orders[epoch - first_epoch];
+}
+
+// A worker may run as far ahead of the caller as there are slots, batch k
+// always going into slot k % depth
+void Loader::work() {
+    std::unique_lock<std::mutex> held(lock);
+    while(true) {
+        changed.wait(held, [&]{ return stopping || claimed < returned + slots.size(); });
+        if(stopping) return;
+        auto sequence = claimed++;
+        auto &slot = slots[sequence % slots.size()];
+        auto &records = order(sequence / per_epoch);
+        held.unlock();
+        try {
+            fill(slot, sequence, records);
+        }
+        catch(...) {
+            held.lock();
+            if(!error) error = std::current_exception();
+            stopping = true;
+            changed.notify_all();
+            return;
+        }
+        held.lock();
+        slot.sequence = sequence;
+        slot.ready = true;
+        changed.notify_all();
+    }
+}
+
+void Loader::fill(Slot& slot, size_t sequence, const std::vector<size_t>& records) {
+    auto begin = sequence % per_epoch * batch_size;
+    auto n = std::min(batch_size, file.size() - begin);
+    auto memory = slot.start;
+    for(size_t f=0; f<file.fields().size(); ++f) {
+        auto count = file.fields()[f].count;
+        auto &tensor = slot.batch.fields[f];
+        tensor.bind(memory, nn::Shape{{n, count, 1, 1}});
+        file.gather(f, records.data() + begin, n, tensor);
+        memory += (batch_size * count + line - 1) / line * line;
+    }
+    slot.batch.size = n;
+}
+
+} // namespace dataset
@@ -0,0 +1,168 @@
+/**
+    Dataset
+    Binary record files read through a memory map, and a loader that
+    assembles shuffled minibatches from them on background threads
+ */
+
+#ifndef DATASET_H
+#define DATASET_H
+
+#include "tensor.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace dataset {
+
+// How the values of a field are stored, every field is read back as doubles
+enum class Type : std::uint64_t { f64, f32, u8 };
+
+/**
+    Field
+    A fixed number of values that every record holds, such as the pixels of
+    an image or its label
+*/
+struct Field {
+    size_t count;
+    Type type;
+};
+
+/**
+    Writer
+    Creates a record file. The file starts with a header listing the number
+    of records and the count and type of each field, and the records follow
+    it back to back from a 64 byte boundary, each holding its fields in
+    order. Values are stored in the byte order of the host.
+*/
+class Writer {
+public:
+    Writer(const std::string&, const std::vector<Field>&);
+    ~Writer();
+    Writer(const Writer&) = delete;
+    Writer& operator=(const Writer&) = delete;
+
+    // Appends one record per column of the tensors, the rows of tensor k
+    // holding field k, the layout a Loader hands batches back in
+    void append(const std::vector<const nn::Tensor*>&);
+
+    // Fills in the number of records and closes the file
+    void close();
+    size_t size() const { return records; }
+
+private:
+    std::FILE* file;
+    std::vector<Field> fields;
+    std::vector<unsigned char> record;
+    size_t records = 0;
+};
+
+/**
+    File
+    A record file mapped read-only into memory, records are only read in
+    from disk as they are touched
+*/
+class File {
+public:
+    explicit File(const std::string&);
+    ~File();
+    File(const File&) = delete;
+    File& operator=(const File&) = delete;
+
+    size_t size() const { return records; }
+    const std::vector<Field>& fields() const { return layout; }
+
+    // Copies field f of n records into the columns of out, which holds n
+    // columns and a row per value of the field
+    void gather(size_t, const size_t*, size_t, nn::Tensor&) const;
+
+    // Tells the kernel the records will be read in order or at random,
+    // which decides how far it reads ahead
+    void advise(bool) const;
+
+private:
+    void* map;
+    size_t length, records, stride;
+    const unsigned char* start;
+    std::vector<Field> layout;
+    // Offset of each field within a record
+    std::vector<size_t> offsets;
+};
+
+/**
+    Loader
+    Streams minibatches of a file epoch after epoch. Each epoch visits the
+    records in a fresh random order by permuting their indices, the records
+    themselves never move. Worker threads assemble the batches ahead of time
+    into a ring of buffers that are allocated once, locked in memory where
+    allowed, and reused, so a depth of 2 double buffers the batches and the
+    training loop only waits when the workers can't keep up.
+*/
+class Loader {
+public:
+    /**
+        Batch
+        A tensor per field of the file with one column per sample. The last
+        batch of an epoch may be smaller, its tensors then have fewer columns.
+    */
+    struct Batch {
+        std::vector<nn::Tensor> fields;
+        size_t size = 0;
+    };
+
+    Loader(const File&, size_t batch, size_t threads=1, size_t depth=2, bool shuffle=true,
+           std::uint64_t seed=0, bool drop_last=false);
+    ~Loader();
+    Loader(const Loader&) = delete;
+    Loader& operator=(const Loader&) = delete;
+
+    // The next batch of the current epoch, or null once it has run out, after
+    // which the following call starts the next epoch. A batch stays valid
+    // until the next call. Rethrows the first exception a worker threw.
+    const Batch* next();
+
+    // Epoch of the last batch returned
+    size_t epoch() const { return delivered ? (delivered - 1) / per_epoch : 0; }
+    size_t batches() const { return per_epoch; }
+
+private:
+    struct Slot {
+        std::unique_ptr<double[]> memory;
+        double* start;
+        size_t length;
+        Batch batch;
+        // Batch the slot holds, counted from the start of the first epoch
+        size_t sequence = 0;
+        bool ready = false;
+    };
+
+    void work();
+    void fill(Slot&, size_t, const std::vector<size_t>&);
+    const std::vector<size_t>& order(size_t);
+
+    const File& file;
+    size_t batch_size, per_epoch;
+    bool shuffle, ended = false;
+    std::uint64_t seed;
+    std::vector<Slot> slots;
+    // Record order of each epoch still being read, from first_epoch on
+    std::deque<std::vector<size_t>> orders;
+    size_t first_epoch = 0;
+    // Batches claimed by workers, handed out and given back by the caller
+    size_t claimed = 0, delivered = 0, returned = 0;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::exception_ptr error;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
+
+} // namespace dataset
+#endif // DATASET_H
@@ -0,0 +1,442 @@
+#include "dist.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace dist {
+
+static std::string address_err = "Addresses take the form tcp:hosts:port, unix:path or shm:name";
+
+// How long a process waits for the rest of its group to join
+static const std::chrono::seconds join_timeout(60);
+
+static std::runtime_error system_error(const std::string& what) {
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+// Start of chunk k when n values are split into count nearly equal chunks
+static size_t chunk_start(size_t n, size_t count, size_t k) {
+    return n / count * k + std::min(k, n % count);
+}
+
+class Transport {
+public:
+    virtual ~Transport() {}
+    virtual void all_reduce(double*, size_t) = 0;
+};
+
+/**
+    Ring
+    Each process holds a socket to the next rank and one from the previous
+    rank. A sum runs a reduce-scatter and then an all-gather around the
+    ring, so each process sends and receives 2 (size - 1) / size of the
+    values whatever the size of the group.
+*/
+class Ring : public Transport {
+public:
+    Ring(size_t, size_t, const std::string&, const std::string&);
+    ~Ring();
+    void all_reduce(double*, size_t);
+private:
+    // Sends to the next rank while receiving from the previous one
+    void exchange(const double*, size_t, double*, size_t);
+    size_t rank, size;
+    int next = -1, previous = -1;
+    std::vector<double> scratch;
+};
+
+/**
+    Endpoint
+    Where rank r of a ring listens, a TCP host and port + r or a Unix
+    socket at path.r
+*/
+struct Endpoint {
+    bool tcp;
+    std::vector<std::string> hosts;
+    std::string path;
+    unsigned long port = 0;
+
+    Endpoint(const std::string& kind, const std::string& where, size_t size) : tcp(kind == "tcp") {
+        if(!tcp) {
+            path = where;
+            return;
+        }
+        auto colon = where.rfind(':');
+        if(colon == std::string::npos) throw std::invalid_argument(address_err);
+        port = std::stoul(where.substr(colon + 1));
+        std::string list = where.substr(0, colon);
+        for(size_t start=0; start<=list.size();) {
+            auto comma = std::min(list.find(',', start), list.size());
+            hosts.push_back(list.substr(start, comma - start));
+            start = comma + 1;
+        }
+        if(hosts.size() != 1 && hosts.size() != size) throw std::invalid_argument(address_err);
+    }
+
+    std::string host(size_t rank) const { return hosts.size() == 1 ? hosts[0] : hosts[rank]; }
+
+    // Socket listening at the address of rank, or connected to it, -1 if the connection was refused
+    int open(size_t rank, bool listening) const {
+        if(!tcp) {
+            sockaddr_un address{};
+            address.sun_family = AF_UNIX;
+            auto name = path + "." + std::to_string(rank);
+            if(name.size() >= sizeof(address.sun_path)) throw std::invalid_argument("Unix socket path is too long");
+            std::strcpy(address.sun_path, name.c_str());
+            auto fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if(fd < 0) throw system_error("socket");
+            if(listening) {
+                unlink(name.c_str());
+                if(bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) throw system_error("bind " + name);
+            }
+            else if(connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+                close(fd);
+                return -1;
+            }
+            return fd;
+        }
+        addrinfo hints{}, *found = nullptr;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if(listening) hints.ai_flags = AI_PASSIVE;
+        auto service = std::to_string(port + rank);
+        if(getaddrinfo(listening ? nullptr : host(rank).c_str(), service.c_str(), &hints, &found)) {
+            throw std::runtime_error("Could not resolve " + host(rank));
+        }
+        auto fd = socket(found->ai_family, found->ai_socktype, found->ai_protocol);
+        if(fd < 0) {
+            freeaddrinfo(found);
+            throw system_error("socket");
+        }
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        if(listening) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            auto bound = bind(fd, found->ai_addr, found->ai_addrlen);
+            freeaddrinfo(found);
+            if(bound < 0) throw system_error("bind port " + service);
+        }
+        else {
+            auto connected = connect(fd, found->ai_addr, found->ai_addrlen);
+            freeaddrinfo(found);
+            if(connected < 0) {
+                close(fd);
+                return -1;
+            }
+        }
+        return fd;
+    }
+};
+
+// Every rank listens before connecting, the connection to the next rank is
+// retried until it is up and the one from the previous rank accepted after
+Ring::Ring(size_t rank_, size_t size_, const std::string& kind, const std::string& where)
+: rank(rank_), size(size_) {
+    Endpoint endpoint(kind, where, size);
+    auto listener = endpoint.open(rank, true);
+    if(listen(listener, 1) < 0) throw system_error("listen");
+    auto deadline = std::chrono::steady_clock::now() + join_timeout;
+    while((next = endpoint.open((rank + 1) % size, false)) < 0) {
+        if(std::chrono::steady_clock::now() > deadline) throw std::runtime_error("Timed out joining the ring");
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    pollfd waiting{listener, POLLIN, 0};
+    auto timeout = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(join_timeout).count());
+    if(poll(&waiting, 1, timeout) <= 0 || (previous = accept(listener, nullptr, nullptr)) < 0) {
+        close(listener);
+        throw std::runtime_error("Timed out joining the ring");
+    }
+    close(listener);
+    if(!endpoint.tcp) unlink((endpoint.path + "." + std::to_string(rank)).c_str());
+    int on = 1;
+    if(endpoint.tcp) setsockopt(previous, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    for(auto fd : {next, previous}) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+Ring::~Ring() {
+    if(next >= 0) close(next);
+    if(previous >= 0) close(previous);
+}
+
+// Both directions make progress together, so neighbours sending to each
+// other at once can't fill their buffers and stall
+void Ring::exchange(const double* out, size_t n_out, double* in, size_t n_in) {
+    auto send_bytes = n_out * sizeof(double), receive_bytes = n_in * sizeof(double);
+    auto sending = reinterpret_cast<const char*>(out);
+    auto receiving = reinterpret_cast<char*>(in);
+    size_t sent = 0, received = 0;
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0;
+#endif
+    while(sent < send_bytes || received < receive_bytes) {
+        // A finished direction is left out, the neighbour may already have
+        // hung up and its POLLHUP would otherwise end or spin the loop
+        pollfd fds[2] = {{sent < send_bytes ? next : -1, POLLOUT, 0},
+                         {received < receive_bytes ? previous : -1, POLLIN, 0}};
+        if(poll(fds, 2, -1) < 0) {
+            if(errno == EINTR) continue;
+            throw system_error("poll");
+        }
+        if(fds[0].revents & (POLLERR | POLLHUP)) throw std::runtime_error("Lost the connection to the next rank");
+        if(fds[0].revents & POLLOUT) {
+            auto n = send(next, sending + sent, send_bytes - sent, flags);
+            if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) throw system_error("send");
+            if(n > 0) sent += static_cast<size_t>(n);
+        }
+        if(fds[1].revents & (POLLIN | POLLHUP)) {
+            auto n = recv(previous, receiving + received, receive_bytes - received, 0);
+            if(n == 0) throw std::runtime_error("Lost the connection to the previous rank");
+            if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) throw system_error("recv");
+            if(n > 0) received += static_cast<size_t>(n);
+        }
+    }
+}
+
+// After step s of the reduce-scatter rank r holds the sum of chunk r - s - 1
+// over s + 2 ranks, so it ends up with the full sum of chunk r + 1 which the
+// all-gather passes around
+void Ring::all_reduce(double* data, size_t n) {
+    auto span = [&](size_t k, size_t& start) {
+        k %= size;
+        start = chunk_start(n, size, k);
+        return chunk_start(n, size, k + 1) - start;
+    };
+    for(size_t s=0; s+1<size; ++s) {
+        size_t out, in;
+        auto n_out = span(rank + size - s, out);
+        auto n_in = span(rank + size - s - 1, in);
+        scratch.resize(n_in);
+        exchange(data + out, n_out, scratch.data(), n_in);
+        for(size_t i=0; i<n_in; ++i) data[in + i] += scratch[i];
+    }
+    for(size_t s=0; s+1<size; ++s) {
+        size_t out, in;
+        auto n_out = span(rank + 1 + size - s, out);
+        auto n_in = span(rank + size - s, in);
+        exchange(data + out, n_out, data + in, n_in);
+    }
+}
+
+/**
+    Shared
+    Processes on one host map one block of memory holding a slot of values
+    per rank and one for the sum. Values are reduced a slot at a time, each
+    rank summing its own chunk of the slot over every rank, with spinning
+    barriers in between.
+*/
+class Shared : public Transport {
+public:
+    Shared(size_t, size_t, const std::string&);
+    ~Shared();
+    void all_reduce(double*, size_t);
+private:
+    struct Header {
+        std::atomic<size_t> arrived, generation;
+        std::atomic<int> ready;
+    };
+    // Values per slot
+    static const size_t capacity = 1 << 17;
+    // Slots start on a cache line after the header
+    static const size_t header_bytes = 64;
+
+    void barrier();
+    double* slot(size_t r) { return reinterpret_cast<double*>(static_cast<char*>(memory) + header_bytes) + r * capacity; }
+
+    size_t rank, size, bytes;
+    void* memory = nullptr;
+    Header* header = nullptr;
+};
+
+// Rank 0 creates the block and the rest wait for it to be ready. Once all
+// have mapped it the name is removed, so nothing is left behind.
+Shared::Shared(size_t rank_, size_t size_, const std::string& where)
+: rank(rank_), size(size_), bytes(header_bytes + (size_ + 1) * capacity * sizeof(double)) {
+    static_assert(sizeof(Header) <= header_bytes, "Shared memory header doesn't fit");
+    auto name = where.empty() || where[0] != '/' ? "/" + where : where;
+    int fd = -1;
+    if(rank == 0) {
+        shm_unlink(name.c_str());
+        fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if(fd < 0) throw system_error("shm_open " + name);
+        if(ftruncate(fd, static_cast<off_t>(bytes)) < 0) throw system_error("ftruncate");
+    }
+    else {
+        auto deadline = std::chrono::steady_clock::now() + join_timeout;
+        struct stat info{};
+        while((fd = shm_open(name.c_str(), O_RDWR, 0600)) < 0 || fstat(fd, &info) < 0
+              || static_cast<size_t>(info.st_size) != bytes) {
+            if(fd >= 0) close(fd);
+            if(std::chrono::steady_clock::now() > deadline) throw std::runtime_error("Timed out joining " + name);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(memory == MAP_FAILED) throw system_error("mmap");
+    header = static_cast<Header*>(memory);
+    if(rank == 0) header->ready.store(1);
+    while(!header->ready.load()) std::this_thread::yield();
+    barrier();
+    if(rank == 0) shm_unlink(name.c_str());
+}
+
+Shared::~Shared() {
+    if(memory) munmap(memory, bytes);
+}
+
+void Shared::barrier() {
+    auto generation = header->generation.load();
+    if(header->arrived.fetch_add(1) + 1 == size) {
+        header->arrived.store(0);
+        header->generation.fetch_add(1);
+        return;
+    }
+    while(header->generation.load() == generation) std::this_thread::yield();
+}
+
+void Shared::all_reduce(double* data, size_t n) {
+    auto sum = slot(size);
+    for(size_t begin=0; begin<n; begin+=capacity) {
+        auto count = std::min(capacity, n - begin);
+        std::copy(data + begin, data + begin + count, slot(rank));
+        barrier();
+        auto lo = chunk_start(count, size, rank), hi = chunk_start(count, size, rank + 1);
+        std::copy(slot(0) + lo, slot(0) + hi, sum + lo);
+        for(size_t r=1; r<size; ++r) {
+            auto values = slot(r);
+            for(size_t i=lo; i<hi; ++i) sum[i] += values[i];
+        }
+        barrier();
+        std::copy(sum, sum + count, data + begin);
+        // Slots are only refilled once every rank has read the sum
+        barrier();
+    }
+}
+
+Group::Group(size_t rank_, size_t size_, const std::string& address)
+: rank(rank_), size(size_) {
+    if(size == 0 || rank >= size) throw std::invalid_argument("Ranks must lie within the group");
+    auto colon = address.find(':');
+    if(colon == std::string::npos) throw std::invalid_argument(address_err);
+    auto kind = address.substr(0, colon), where = address.substr(colon + 1);
+    if(kind != "shm" && kind != "tcp" && kind != "unix") throw std::invalid_argument(address_err);
+    if(size == 1) return;
+    if(kind == "shm") transport.reset(new Shared(rank, size, where));
+    else transport.reset(new Ring(rank, size, kind, where));
+}
+
+Group::~Group() {}
+
+void Group::all_reduce(double* data, size_t n) {
+    if(transport) transport->all_reduce(data, n);
+}
+
+// Parameters come newest first and the arena holds them in creation order,
+// so each bucket grows downwards through the arena
+Reducer::Reducer(Group& group_, nn::Net& net_, size_t bucket_bytes)
+: group(group_), net(net_) {
+    auto values = net.flat_params();
+    auto grads = net.flat_grad();
+    // Every process starts from the parameters of rank 0
+    if(group.rank) std::fill(values.ptr(), values.ptr() + values.size, 0);
+    group.all_reduce(values.ptr(), values.size);
+    auto limit = std::max<size_t>(1, bucket_bytes / sizeof(double));
+    auto end = values.size;
+    for(auto &parameter : net.params()) {
+        if(parameter.row_grad()) throw std::invalid_argument("Gradients can only be reduced across processes for dense parameters");
+        auto offset = static_cast<size_t>(parameter.data.ptr() - values.ptr());
+        if(offset + parameter.data.size != end) throw std::logic_error("Reduced parameters must sit in the net's arena");
+        end = offset;
+        if(buckets.empty() || buckets.back()->size >= limit) {
+            buckets.emplace_back(new Bucket);
+            buckets.back()->size = 0;
+            buckets.back()->parameters = 0;
+        }
+        auto &bucket = *buckets.back();
+        bucket.grads = grads.ptr() + offset;
+        bucket.size += parameter.data.size;
+        ++bucket.parameters;
+        parameter.set_grad_hook([this, &bucket]{ completed(bucket); });
+    }
+    for(auto &bucket : buckets) bucket->pending = bucket->parameters;
+    worker = std::thread([this]{ work(); });
+}
+
+Reducer::~Reducer() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    ready.notify_all();
+    worker.join();
+    for(auto &parameter : net.params()) parameter.set_grad_hook(nullptr);
+}
+
+void Reducer::completed(Bucket& bucket) {
+    if(bucket.pending.fetch_sub(1) != 1) return;
+    std::lock_guard<std::mutex> guard(lock);
+    ready.notify_one();
+}
+
+// Buckets are taken strictly in order so every process issues the same
+// sequence of reductions, a later bucket finishing early waits its turn
+void Reducer::work() {
+    std::unique_lock<std::mutex> held(lock);
+    while(true) {
+        ready.wait(held, [&]{
+            return stopping || (reduced < buckets.size() && (flushing || buckets[reduced]->pending == 0));
+        });
+        if(stopping) return;
+        auto &bucket = *buckets[reduced];
+        auto failed = static_cast<bool>(error);
+        held.unlock();
+        std::exception_ptr caught;
+        if(!failed) {
+            try {
+                group.all_reduce(bucket.grads, bucket.size);
+                auto scale = 1 / static_cast<double>(group.size);
+                for(size_t i=0; i<bucket.size; ++i) bucket.grads[i] *= scale;
+            }
+            catch(...) {
+                caught = std::current_exception();
+            }
+        }
+        held.lock();
+        if(caught) error = caught;
+        ++reduced;
+        done.notify_all();
+    }
+}
+
+void Reducer::finish() {
+    std::unique_lock<std::mutex> held(lock);
+    flushing = true;
+    ready.notify_one();
+    done.wait(held, [&]{ return reduced == buckets.size(); });
+    flushing = false;
+    reduced = 0;
+    for(auto &bucket : buckets) bucket->pending = bucket->parameters;
+    if(error) {
+        auto caught = error;
+        error = nullptr;
+        std::rethrow_exception(caught);
+    }
+}
+
+} // namespace dist
@@ -0,0 +1,95 @@
+/**
+    Dist
+    Data-parallel training across processes, on one host or several
+ */
+
+#ifndef DIST_H
+#define DIST_H
+
+#include "net.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace dist {
+
+// Moves values between the processes of a group, defined in dist.cc
+class Transport;
+
+/**
+    Group
+    A fixed set of processes that reduce values together, each knowing its
+    rank and the number of processes. Addresses pick the transport:
+    "tcp:hosts:port" and "unix:path" connect the processes in a ring, rank r
+    listening on port + r or on path.r, and "shm:name" shares one block of
+    memory between processes on the same host. hosts is one host for the
+    whole group or a comma separated host per rank.
+*/
+class Group {
+public:
+    Group(size_t, size_t, const std::string&);
+    ~Group();
+    Group(const Group&) = delete;
+    Group& operator=(const Group&) = delete;
+
+    // Sums n values in place across every process of the group
+    void all_reduce(double*, size_t);
+
+    const size_t rank, size;
+
+private:
+    std::unique_ptr<Transport> transport;
+};
+
+/**
+    Reducer
+    Averages the gradients of a net over a group every step. The gradient
+    arena is split into buckets of whole parameters, starting from the last
+    created as backward passes complete those first. A bucket is reduced on
+    a separate thread as soon as the backward pass has finished all of its
+    parameters, so communication overlaps the rest of the pass. Buckets are
+    always reduced in the same order on every process. Each step should run
+    one backward pass and then finish before stepping the optimiser.
+*/
+class Reducer {
+public:
+    // Parameters are synchronised to those of rank 0 on construction
+    Reducer(Group&, nn::Net&, size_t bucket_bytes = 1 << 22);
+    ~Reducer();
+    Reducer(const Reducer&) = delete;
+    Reducer& operator=(const Reducer&) = delete;
+
+    // Reduces the buckets the backward pass didn't complete and waits for
+    // every bucket, rethrowing any error the reduction hit
+    void finish();
+
+private:
+    struct Bucket {
+        double* grads;
+        size_t size, parameters;
+        std::atomic<size_t> pending;
+    };
+
+    void work();
+    void completed(Bucket&);
+
+    Group& group;
+    nn::Net& net;
+    std::vector<std::unique_ptr<Bucket>> buckets;
+    std::mutex lock;
+    std::condition_variable ready, done;
+    // Buckets reduced so far this step
+    size_t reduced = 0;
+    bool flushing = false, stopping = false;
+    std::exception_ptr error;
+    std::thread worker;
+};
+
+} // namespace dist
+#endif // DIST_H
@@ -0,0 +1,89 @@
+#include "autodiff.hpp"
+#include "dist.hpp"
+#include "layers.hpp"
+#include "loss.hpp"
+#include "net.hpp"
+#include "optim.hpp"
+
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Trains a small classifier with one process per shard of each batch.
+// Usage: dist_example [processes] [address], every process is forked from
+// the first so the whole group runs on this host.
+
+class Model : public nn::Net{
+    public:
+    Model() : nn::Net(), fc1(8, 32, this), fc2(32, 3, this){ }
+
+    nn::FullyConnected fc1, fc2;
+    autodiff::Var forward(autodiff::Var& x) {
+        return fc2(autodiff::tanh(fc1(x)));
+    }
+};
+
+// Each column of a shard is labelled by which of its first three rows is largest
+static void shard(nn::Tensor& x, nn::Tensor& labels) {
+    x.randn();
+    for(size_t c=0; c<x.shape[0]; ++c) {
+        size_t best = 0;
+        for(size_t r=1; r<3; ++r) if(x(c, r) > x(c, best)) best = r;
+        labels(c) = static_cast<double>(best);
+    }
+}
+
+static int train(size_t rank, size_t size, const std::string& address) {
+    dist::Group group(rank, size, address);
+    Model model;
+    dist::Reducer reducer(group, model);
+    opt::Adam optimiser(model.params(), 1e-2);
+    nn::Tensor x(16, 8), labels(16);
+    for(size_t step=0; step<200; ++step) {
+        shard(x, labels);
+        autodiff::Var input(x), target(labels);
+        auto output = model.forward(input);
+        auto l = loss::cross_entropy_loss(output, target);
+        model.backward(l);
+        reducer.finish();
+        optimiser.step();
+        model.zero_grad();
+        if(rank == 0 && step % 50 == 49) std::cout << "step " << step + 1 << " loss " << l(0) << std::endl;
+    }
+    // Every process should hold the same parameters
+    auto values = model.flat_params();
+    double check[2] = {values.sum(), 1};
+    group.all_reduce(check, 2);
+    auto agree = std::fabs(check[0] - check[1] * values.sum()) <= 1e-9 * (1 + std::fabs(check[0]));
+    if(rank == 0) std::cout << (agree ? "replicas agree" : "replicas diverged") << std::endl;
+    return agree ? 0 : 1;
+}
+
+int main(int argc, char** argv){
+    size_t size = argc > 1 ? std::stoul(argv[1]) : 4;
+    std::string address = argc > 2 ? argv[2] : "unix:/tmp/nn_dist";
+    size_t rank = 0;
+    for(size_t r=1; r<size; ++r) {
+        if(fork() == 0) {
+            rank = r;
+            break;
+        }
+    }
+    auto status = 0;
+    try {
+        status = train(rank, size, address);
+    }
+    catch(const std::exception& e) {
+        std::cerr << "rank " << rank << ": " << e.what() << std::endl;
+        status = 1;
+    }
+    if(rank != 0) return status;
+    for(size_t r=1; r<size; ++r) {
+        int child = 0;
+        wait(&child);
+        if(!WIFEXITED(child) || WEXITSTATUS(child)) status = 1;
+    }
+    return status;
+}
@@ -8,7 +8,7 @@
 
 class Model : public nn::Net{
     public:
-    Model() : nn::Net(), fc1(10, 1, this){ }
+    Model() : nn::Net(), fc1(10, 3, this){ }
 
     nn::FullyConnected fc1;
     autodiff::Var forward(autodiff::Var& x) {
@@ -21,7 +21,7 @@ int main(){
     nn::Tensor a(1,10);
     nn::Tensor z(1);
     a.rand(0,1);
-    z.rand(0,1);
+    z.constant(2);
     std::cout << a.row(0);
     std::cout << a.col(0);
     autodiff::Var var_a(a);
@@ -33,5 +33,6 @@ int main(){
     auto l = loss::cross_entropy_loss(y, var_z);
     model.backward(y);
     opt.step();
+    model.zero_grad();
     std::cout << l;
 }
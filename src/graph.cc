@@ -0,0 +1,392 @@
+#include "graph.hpp"
+#include "tape.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <unordered_map>
+
+namespace autodiff {
+
+using std::vector;
+using std::invalid_argument;
+using std::logic_error;
+using nn::Tensor;
+
+static const size_t no_slot = untracked;
+static std::string unbound_err = "Captured graphs may only depend on their inputs, parameters and Vars created during capture";
+
+// Captured nodes take the first slots in tape order, followed by the
+// inputs and then the parameters
+Graph::Graph(const vector<Var*>& inputs, std::forward_list<Var>& parameters, const std::function<Var()>& fn) {
+    if(!grad_enabled()) throw logic_error("Graphs can't be captured under a NoGradGuard");
+    auto start = tape.size();
+    std::unique_ptr<Var> result;
+    tape.constants.clear();
+    tape.capturing = true;
+    try {
+        result.reset(new Var(fn()));
+    }
+    catch(...) {
+        tape.capturing = false;
+        tape.drop(start);
+        throw;
+    }
+    tape.capturing = false;
+    auto end = tape.size();
+    if(result->index == untracked || result->index < start) {
+        tape.drop(start);
+        throw invalid_argument("The captured output must be computed during capture");
+    }
+
+    std::unordered_map<size_t, size_t> external;
+    auto slots = end - start;
+    for(auto input : inputs) {
+        if(input->index == untracked || input->index >= start) {
+            tape.drop(start);
+            throw invalid_argument("Graph inputs must be recorded before capture");
+        }
+        external[input->index] = slots;
+        input_slots.push_back(slots++);
+    }
+    for(auto &parameter : parameters) {
+        external[parameter.index] = slots++;
+    }
+    // Operands created outside the tape, such as under a NoGradGuard, are
+    // baked in as constant slots after the parameters
+    auto first_constant = slots;
+    std::unordered_map<size_t, size_t> constant_slots;
+    for(auto &constant : tape.constants) {
+        constant_slots[constant.first] = slots++;
+    }
+    auto slot = [&](size_t index) {
+        if(index != untracked && index >= start) return index - start;
+        auto found = external.find(index);
+        if(found == external.end()) {
+            tape.drop(start);
+            throw invalid_argument(unbound_err);
+        }
+        return found->second;
+    };
+
+    values.resize(slots);
+    grads.resize(slots);
+    params.assign(slots, nullptr);
+    param_index.assign(slots, untracked);
+    needs_grad.assign(slots, 0);
+    vector<char> requires_grad(slots, 0);
+    for(size_t k=0; k<inputs.size(); ++k) {
+        auto s = input_slots[k];
+        store(values[s], inputs[k]->data);
+        requires_grad[s] = tape.requires_grad(inputs[k]->index);
+    }
+    for(auto &parameter : parameters) {
+        auto s = external[parameter.index];
+        params[s] = &parameter.data;
+        param_index[s] = parameter.index;
+        requires_grad[s] = tape.requires_grad(parameter.index);
+    }
+    for(auto &constant : tape.constants) {
+        values[constant_slots[constant.first]] = std::move(constant.second);
+    }
+    tape.constants.clear();
+    for(auto i=start; i<end; ++i) {
+        auto &node = tape.nodes[i];
+        if(node.type == OpType::checkpoint) {
+            tape.drop(start);
+            throw logic_error("Checkpointed segments can't be captured");
+        }
+        // The sparse input lives with the node rather than in a replayable slot
+        if(node.type == OpType::sparse_linear) {
+            tape.drop(start);
+            throw logic_error("Products with sparse inputs can't be captured");
+        }
+        store(values[i - start], tape.values[i]);
+        requires_grad[i - start] = node.requires_grad;
+        if(node.type == OpType::leaf) continue;
+        std::array<size_t, 3> args;
+        for(size_t k=0; k<3; ++k) {
+            auto constant = constant_slots.find(3 * i + k);
+            if(constant != constant_slots.end()) args[k] = constant->second;
+            else args[k] = k > 0 && node.parents[k] == untracked ? no_slot : slot(node.parents[k]);
+        }
+        steps.push_back({node.type, node.scalar, args, i - start, false});
+    }
+    out_slot = result->index - start;
+    tape.drop(start);
+    tape.values.clear();
+    fuse();
+
+    // Plans the backward pass over the slots that lead to a gradient
+    needs_grad[out_slot] = requires_grad[out_slot];
+    for(auto step = steps.rbegin(); step != steps.rend(); ++step) {
+        if(!needs_grad[step->out]) continue;
+        for(auto arg : step->args) {
+            if(arg != no_slot && requires_grad[arg]) needs_grad[arg] = 1;
+        }
+    }
+    plan();
+    for(size_t s=0; s<first_constant; ++s) {
+        if(params[s] || producer[s] != no_slot) continue;
+        grads[s].resize(values[s].shape);
+        grads[s].zeros();
+    }
+}
+
+// Lifetimes are measured on one timeline, forward step k runs at time k and
+// its vector-Jacobian product at 2n-1-k. Values live until their last read
+// in either pass, gradients from their first write until their producer
+// reads them. Buffers are placed largest first at the lowest offset that
+// doesn't overlap a placed buffer live at the same time.
+void Graph::plan() {
+    auto n = steps.size();
+    auto slots = values.size();
+    auto backward_time = [n](size_t k) { return 2 * n - 1 - k; };
+    producer.assign(slots, no_slot);
+    first_write.assign(slots, no_slot);
+    for(size_t k=0; k<n; ++k) {
+        producer[steps[k].out] = k;
+    }
+
+    struct Interval {
+        size_t size, start, end, offset;
+    };
+    vector<Interval> buffers;
+    vector<size_t> value_buffer(slots, no_slot);
+    vector<size_t> grad_buffer(slots, no_slot);
+    for(size_t k=0; k<n; ++k) {
+        auto out = steps[k].out;
+        value_buffer[out] = buffers.size();
+        buffers.push_back({values[out].size, k, out == out_slot ? 2 * n : k, 0});
+    }
+    auto read = [&](size_t slot, size_t time) {
+        if(slot == no_slot || value_buffer[slot] == no_slot) return;
+        auto &buffer = buffers[value_buffer[slot]];
+        buffer.end = std::max(buffer.end, time);
+    };
+    for(size_t k=0; k<n; ++k) {
+        auto &step = steps[k];
+        for(auto arg : step.args) {
+            read(arg, k);
+        }
+        if(!needs_grad[step.out]) continue;
+        auto kept = saves(step.type);
+        if(kept & save_x) read(step.args[0], backward_time(k));
+        if(kept & save_y) read(step.args[1], backward_time(k));
+        if(kept & save_out) read(step.out, backward_time(k));
+    }
+
+    for(size_t k=n; k-- >0;) {
+        if(!needs_grad[steps[k].out]) continue;
+        for(auto arg : steps[k].args) {
+            if(arg != no_slot && needs_grad[arg] && first_write[arg] == no_slot) first_write[arg] = k;
+        }
+    }
+    for(size_t k=n; k-- >0;) {
+        auto &step = steps[k];
+        auto out = step.out;
+        if(!needs_grad[out]) continue;
+        if(grad_buffer[out] == no_slot) {
+            auto begin = out == out_slot ? n : backward_time(first_write[out]);
+            grad_buffer[out] = buffers.size();
+            buffers.push_back({values[out].size, begin, backward_time(k), 0});
+        }
+        auto &buffer = buffers[grad_buffer[out]];
+        buffer.end = std::max(buffer.end, backward_time(k));
+        // The gradient of x can take over the output gradient if this is its first write
+        auto x = step.args[0];
+        step.in_place = in_place(step.type) && x != out_slot && needs_grad[x]
+            && producer[x] != no_slot && first_write[x] == k
+            && x != step.args[1] && x != step.args[2];
+        if(step.in_place) grad_buffer[x] = grad_buffer[out];
+    }
+
+    vector<size_t> order(buffers.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return buffers[a].size > buffers[b].size;
+    });
+    vector<const Interval*> placed, live;
+    size_t total = 0;
+    footprint.naive = 0;
+    for(auto b : order) {
+        auto &buffer = buffers[b];
+        live.clear();
+        for(auto other : placed) {
+            if(other->start <= buffer.end && buffer.start <= other->end) live.push_back(other);
+        }
+        std::sort(live.begin(), live.end(), [](const Interval* a, const Interval* c) {
+            return a->offset < c->offset;
+        });
+        size_t offset = 0;
+        for(auto other : live) {
+            if(other->offset >= offset + buffer.size) break;
+            offset = std::max(offset, other->offset + other->size);
+        }
+        buffer.offset = offset;
+        total = std::max(total, offset + buffer.size);
+        footprint.naive += buffer.size * sizeof(double);
+        placed.push_back(&buffer);
+    }
+    footprint.planned = total * sizeof(double);
+
+    slab.reset(new double[total]);
+    for(size_t s=0; s<slots; ++s) {
+        auto shape = values[s].shape;
+        if(value_buffer[s] != no_slot) values[s] = Tensor(slab.get() + buffers[value_buffer[s]].offset, shape);
+        if(grad_buffer[s] != no_slot) grads[s] = Tensor(slab.get() + buffers[grad_buffer[s]].offset, shape);
+    }
+}
+
+// Each pattern is matched backwards from its last step, an intermediate is
+// only folded away if nothing else reads it. The fused step takes over the
+// slot of the last step so the order of the plan stays valid.
+void Graph::fuse() {
+    vector<size_t> uses(values.size(), 0);
+    vector<size_t> source(values.size(), no_slot);
+    for(size_t k=0; k<steps.size(); ++k) {
+        for(auto arg : steps[k].args) {
+            if(arg != no_slot) ++uses[arg];
+        }
+        source[steps[k].out] = k;
+    }
+    ++uses[out_slot];
+    vector<char> fused(steps.size(), 0);
+    // The step producing a slot if it is its only reader, otherwise null
+    auto only_reader = [&](size_t slot, OpType type) -> Step* {
+        if(slot == no_slot || uses[slot] != 1 || source[slot] == no_slot) return nullptr;
+        auto &step = steps[source[slot]];
+        return step.type == type ? &step : nullptr;
+    };
+    auto fold = [&](const Step* step) {
+        fused[source[step->out]] = 1;
+        values[step->out].resize({{1,1,1,1}});
+    };
+
+    for(auto &step : steps) {
+        switch(step.type) {
+            // Matrix product followed by a bias, from Var operators
+            case OpType::add:
+                for(size_t side=0; side<2; ++side) {
+                    auto product = only_reader(step.args[side], OpType::matmul);
+                    if(!product) continue;
+                    step = {OpType::linear, 0, {{product->args[0], product->args[1], step.args[1 - side]}}, step.out, false};
+                    fold(product);
+                    break;
+                }
+                break;
+            // Activations of a linear layer whose derivative needs only their
+            // output, gelu's needs the pre-activation the fusion would drop
+            case OpType::relu:
+            case OpType::tanh:
+            case OpType::sigmoid: {
+                auto layer = only_reader(step.args[0], OpType::linear);
+                if(!layer) break;
+                step = {OpType::linear_act, static_cast<double>(static_cast<int>(step.type)), layer->args, step.out, false};
+                fold(layer);
+                break;
+            }
+            // Squared and absolute error reductions, as in the loss functions
+            case OpType::sum:
+            case OpType::abs_sum: {
+                auto square = only_reader(step.args[0], OpType::pow_const);
+                if(square && square->scalar == 2) {
+                    auto diff = only_reader(square->args[0], OpType::sub);
+                    if(!diff) break;
+                    step = {OpType::sq_err_sum, 0, {{diff->args[0], diff->args[1], no_slot}}, step.out, false};
+                    fold(square);
+                    fold(diff);
+                    break;
+                }
+                auto diff = only_reader(step.args[0], OpType::sub);
+                if(!diff || step.type != OpType::abs_sum) break;
+                step = {OpType::abs_err_sum, 0, {{diff->args[0], diff->args[1], no_slot}}, step.out, false};
+                fold(diff);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    size_t kept = 0;
+    for(size_t k=0; k<steps.size(); ++k) {
+        if(!fused[k]) steps[kept++] = steps[k];
+    }
+    steps.resize(kept);
+}
+
+const Tensor& Graph::value(size_t slot) const {
+    return params[slot] ? *params[slot] : values[slot];
+}
+
+Tensor* Graph::gradient(size_t slot) {
+    if(slot == no_slot || !needs_grad[slot]) return nullptr;
+    if(params[slot]) return &tape.grad(param_index[slot]);
+    return &grads[slot];
+}
+
+const Tensor& Graph::forward(const vector<Tensor>& inputs) {
+    if(inputs.size() != input_slots.size()) throw invalid_argument("Wrong number of graph inputs");
+    for(size_t k=0; k<inputs.size(); ++k) {
+        if(inputs[k].shape != values[input_slots[k]].shape) throw invalid_argument("Graph input sizes are fixed by the capture");
+        values[input_slots[k]] = inputs[k];
+    }
+    for(auto &step : steps) {
+        auto &x = value(step.args[0]);
+        auto &y = step.args[1] == no_slot ? x : value(step.args[1]);
+        auto &z = step.args[2] == no_slot ? x : value(step.args[2]);
+        apply(step.type, step.scalar, x, y, z, values[step.out]);
+    }
+    return values[out_slot];
+}
+
+// Gradients outside the plan are zeroed up front, planned ones just before
+// their first write since their memory may still hold other buffers
+void Graph::backward() {
+    if(!needs_grad[out_slot]) return;
+    for(size_t s=0; s<grads.size(); ++s) {
+        if(needs_grad[s] && !params[s] && producer[s] == no_slot) grads[s].zeros();
+    }
+    grads[out_slot].ones();
+    for(size_t k=steps.size(); k-- >0;) {
+        auto &step = steps[k];
+        if(!needs_grad[step.out]) continue;
+        for(size_t i=0; i<3; ++i) {
+            auto arg = step.args[i];
+            if(arg == no_slot || first_write[arg] != k || producer[arg] == no_slot) continue;
+            if(!(step.in_place && i == 0)) grads[arg].zeros();
+        }
+        auto &x = value(step.args[0]);
+        auto &y = step.args[1] == no_slot ? x : value(step.args[1]);
+        Operands in{&x, &y, &values[step.out]};
+        auto &g = grads[step.out];
+        auto table = step.args[0];
+        if(step.type == OpType::embedding && params[table] && tape.rows(param_index[table])) {
+            embedding_vjp(g, y, *tape.rows(param_index[table]));
+            continue;
+        }
+        if(!step.in_place) {
+            vjp(step.type, step.scalar, g, in,
+                gradient(step.args[0]), gradient(step.args[1]), gradient(step.args[2]));
+            continue;
+        }
+        vjp_in_place(step.type, step.scalar, g, in);
+        if(step.args[1] != no_slot) {
+            vjp(step.type, step.scalar, g, in, nullptr, gradient(step.args[1]), gradient(step.args[2]));
+        }
+    }
+}
+
+const Tensor& Graph::replay(const vector<Tensor>& inputs) {
+    forward(inputs);
+    backward();
+    return values[out_slot];
+}
+
+const Tensor& Graph::output() const { return values[out_slot]; }
+
+const Tensor& Graph::grad(size_t input) const { return grads.at(input_slots.at(input)); }
+
+} // namespace autodiff
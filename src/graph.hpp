@@ -0,0 +1,103 @@
+/**
+    Graph
+    Capture and replay of a recorded forward and backward pass
+ */
+
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include "autodiff.hpp"
+
+#include <forward_list>
+#include <memory>
+#include <vector>
+#include <array>
+
+namespace autodiff {
+
+/**
+    Graph
+    A forward pass recorded once and turned into a fixed execution plan.
+    Every value and gradient gets a buffer at capture time, replaying the
+    plan with new inputs skips the tape entirely and reuses those buffers.
+    The shapes of the inputs are fixed by the capture.
+*/
+class Graph {
+public:
+    // Records fn once, the inputs are the Vars replaced on each replay and
+    // parameters are read live so optimiser updates are picked up.
+    // Any other Var fn depends on must be created inside it, those off the
+    // tape are kept as constants with their values at capture.
+    Graph(const std::vector<Var*>&, std::forward_list<Var>&, const std::function<Var()>&);
+
+    // Runs the plan forward with new input data and then backpropagates
+    // from the output, parameter gradients accumulate on the tape
+    const nn::Tensor& replay(const std::vector<nn::Tensor>&);
+
+    // Runs only the forward half of the plan
+    const nn::Tensor& forward(const std::vector<nn::Tensor>&);
+
+    // Output of the last replay
+    const nn::Tensor& output() const;
+
+    // Gradient of an input from the last replay, zero if it doesn't require gradients
+    const nn::Tensor& grad(size_t) const;
+
+    // Number of operations in the plan
+    size_t size() const { return steps.size(); }
+
+    /**
+        Memory
+        Bytes taken by the intermediate values and gradients of the plan,
+        with a buffer each for the whole pass and as packed into the slab
+    */
+    struct Memory {
+        size_t naive;
+        size_t planned;
+    };
+    Memory memory() const { return footprint; }
+
+private:
+    /**
+        Step
+        One operation of the plan, arguments and output are value slots
+    */
+    struct Step {
+        OpType type;
+        double scalar;
+        std::array<size_t, 3> args;
+        size_t out;
+        // Whether the gradient of args[0] overwrites the output gradient
+        bool in_place;
+    };
+
+    // Rewrites chains of steps into fused operations
+    void fuse();
+    // Assigns the intermediate buffers to offsets in the slab
+    void plan();
+    void backward();
+    const nn::Tensor& value(size_t) const;
+    nn::Tensor* gradient(size_t);
+
+    std::vector<Step> steps;
+    // Value and gradient buffers, one per slot, intermediates are views into the slab
+    std::vector<nn::Tensor> values;
+    std::vector<nn::Tensor> grads;
+    std::unique_ptr<double[]> slab;
+    Memory footprint;
+    // Step computing each slot, none for inputs, parameters and constants
+    std::vector<size_t> producer;
+    // Step whose vector-Jacobian product first writes each gradient
+    std::vector<size_t> first_write;
+    // Live parameter data for slots bound to parameters, null otherwise
+    std::vector<const nn::Tensor*> params;
+    // Tape index of the parameter leaf a slot accumulates into
+    std::vector<size_t> param_index;
+    // Whether a slot is reached by the backward pass
+    std::vector<char> needs_grad;
+    std::vector<size_t> input_slots;
+    size_t out_slot;
+};
+
+} // namespace autodiff
+#endif // GRAPH_H
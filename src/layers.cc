@@ -1,12 +1,24 @@
 #include "layers.hpp"
+#include <algorithm>
 #include <string>
 #include <cmath>
+#include <stdexcept>
+#include <utility>
 
 namespace nn{
 
 using autodiff::Var;
 
 static std::string dim_err ="Input tensors to fully connected layers must be 1D tensors";
+static std::string feature_err ="Inputs must have one row per normalised feature";
+static std::string head_err ="Attention needs one row per feature, split evenly between the heads";
+static std::string fold_err ="Batch norm can only fold into a layer with one output per feature";
+static std::string quant_err ="Quantized layers need one row per input feature";
+
+// Largest magnitude of a quantized value, the range is kept symmetric
+static const double int8_max = 127;
+// Inputs are stored as unsigned bytes offset by this much
+static const std::int32_t input_offset = 128;
 
 FullyConnected::FullyConnected(size_t in_size, size_t out_size, Net* net)
 : weight(net->create_parameter(Tensor(in_size, out_size))),
@@ -16,11 +28,240 @@ FullyConnected::FullyConnected(size_t in_size, size_t out_size, Net* net)
 }
     
 Var FullyConnected::operator()(const Var& input){
-    auto result = weight * input;
-    result += bias;
+    return autodiff::linear(weight, input, bias);
+}
+
+Var FullyConnected::operator()(const SparseTensor& input){
+    return autodiff::linear(weight, input, bias);
+}
+
+// A Var kept off the tape, for values a layer sets itself rather than learns
+static Var constant(const Tensor& data) {
+    autodiff::NoGradGuard no_grad;
+    return Var(data);
+}
+
+BatchNorm::BatchNorm(size_t features, Net* net, double eps_, double momentum_)
+: gamma(net->create_parameter(Tensor({{1, features, 1, 1}}, 1))),
+  beta(net->create_parameter(Tensor({{1, features, 1, 1}}, 0))),
+  running_mean(Tensor({{1, features, 1, 1}}, 0)), running_var(Tensor({{1, features, 1, 1}}, 1)),
+  scale(constant(Tensor({{1, features, 1, 1}}, 1))), shift(constant(Tensor({{1, features, 1, 1}}, 0))),
+  eps(eps_), momentum(momentum_) {}
+
+// Inference applies the running statistics as a scale and shift per row,
+// recorded as one operation on the input
+Var BatchNorm::operator()(const Var& input){
+    if(folded) return input;
+    if(training) {
+        auto result = autodiff::batch_norm(input, gamma, beta, eps);
+        auto features = running_mean.size;
+        Tensor mean(features), var(features);
+        moments(input.data, mean, var, true);
+        // The running variance is unbiased like the one used at inference
+        auto n = static_cast<double>(input.data.shape[0]);
+        auto correction = n > 1 ? n / (n - 1) : 1;
+        for(size_t r=0; r<features; ++r) {
+            running_mean(0, r) += momentum * (mean(r) - running_mean(0, r));
+            running_var(0, r) += momentum * (var(r) * correction - running_var(0, r));
+        }
+        return result;
+    }
+    auto &x = input.data;
+    if(x.size / x.shape[0] != running_mean.size) throw std::invalid_argument(feature_err);
+    for(size_t r=0; r<running_mean.size; ++r) {
+        auto s = gamma(0, r) / std::sqrt(running_var(0, r) + eps);
+        scale(0, r) = s;
+        shift(0, r) = beta(0, r) - s * running_mean(0, r);
+    }
+    // Graphs capture scale and shift as constants, replaying these statistics
+    return autodiff::scale_shift(input, scale, shift);
+}
+
+// Scaling row r of the weight and bias by gamma / sqrt(var + eps) and
+// shifting the bias gives the composed affine map in one linear layer
+void BatchNorm::fold(FullyConnected& layer){
+    if(folded) throw std::logic_error("Batch norm has already been folded");
+    auto &weight = layer.weight.data;
+    auto &bias = layer.bias.data;
+    auto features = running_mean.size;
+    if(weight.shape[1] != features) throw std::invalid_argument(fold_err);
+    for(size_t r=0; r<features; ++r) {
+        auto factor = gamma(0, r) / std::sqrt(running_var(0, r) + eps);
+        for(size_t c=0; c<weight.shape[0]; ++c) weight(c, r) *= factor;
+        bias(0, r) = factor * (bias(0, r) - running_mean(0, r)) + beta(0, r);
+    }
+    folded = true;
+    training = false;
+}
+
+// Weights are drawn uniformly from +-1/sqrt(fan), the recurrent GRU
+// weight holds its bias in the extra column
+static Var& uniform_parameter(Net* net, size_t in, size_t out, size_t fan) {
+    auto &parameter = net->create_parameter(Tensor(in, out));
+    auto bound = 1 / std::sqrt(static_cast<double>(fan));
+    parameter.data.rand(-bound, bound);
+    return parameter;
+}
+
+LSTM::LSTM(size_t in_size, size_t hidden, Net* net)
+: weight_ih(uniform_parameter(net, in_size, 4 * hidden, hidden)),
+  bias(uniform_parameter(net, 1, 4 * hidden, hidden)),
+  weight_hh(uniform_parameter(net, hidden, 4 * hidden, hidden)) {}
+
+Var LSTM::operator()(const Var& input, size_t batch){
+    return autodiff::lstm(autodiff::linear(weight_ih, input, bias), weight_hh, batch);
+}
+
+GRU::GRU(size_t in_size, size_t hidden, Net* net)
+: weight_ih(uniform_parameter(net, in_size, 3 * hidden, hidden)),
+  bias(uniform_parameter(net, 1, 3 * hidden, hidden)),
+  weight_hh(uniform_parameter(net, hidden + 1, 3 * hidden, hidden)) {}
+
+Var GRU::operator()(const Var& input, size_t batch){
+    return autodiff::gru(autodiff::linear(weight_ih, input, bias), weight_hh, batch);
+}
+
+MultiHeadAttention::MultiHeadAttention(size_t dim, size_t heads_, Net* net)
+: weight_qkv(uniform_parameter(net, dim, 3 * dim, dim)),
+  bias_qkv(net->create_parameter(Tensor({{1, 3 * dim, 1, 1}}, 0))),
+  weight_out(uniform_parameter(net, dim, dim, dim)),
+  bias_out(net->create_parameter(Tensor({{1, dim, 1, 1}}, 0))),
+  heads(heads_), keys(1, dim), values(1, dim) {
+    if(heads == 0 || dim % heads) throw std::invalid_argument(head_err);
+}
+
+Var MultiHeadAttention::operator()(const Var& input, bool causal){
+    auto qkv = autodiff::linear(weight_qkv, input, bias_qkv);
+    return autodiff::linear(weight_out, autodiff::attention(qkv, heads, causal), bias_out);
+}
+
+// Doubles the column capacity of a cache while keeping its first columns
+static void grow(Tensor& cache, size_t used) {
+    Tensor larger(2 * cache.shape[0], cache.shape[1]);
+    for(size_t r=0; r<cache.shape[1]; ++r) {
+        for(size_t c=0; c<used; ++c) larger(c, r) = cache(c, r);
+    }
+    cache = std::move(larger);
+}
+
+Tensor MultiHeadAttention::decode(const Tensor& input){
+    auto dim = keys.shape[1];
+    auto count = input.shape[0];
+    if(input.size / count != dim) throw std::invalid_argument(head_err);
+    auto qkv = weight_qkv.data * input;
+    for(size_t i=0; i<qkv.size; ++i) qkv.ptr()[i] += bias_qkv.data.ptr()[i / count];
+    while(length + count > keys.shape[0]) {
+        grow(keys, length);
+        grow(values, length);
+    }
+    for(size_t r=0; r<dim; ++r) {
+        for(size_t c=0; c<count; ++c) {
+            keys(length + c, r) = qkv(c, dim + r);
+            values(length + c, r) = qkv(c, 2 * dim + r);
+        }
+    }
+    length += count;
+    Tensor queries(qkv.ptr(), {{count, dim, 1, 1}});
+    Tensor merged(queries.shape);
+    attention(queries, keys, values, length, heads, length - count, true, merged);
+    auto result = weight_out.data * merged;
+    for(size_t i=0; i<result.size; ++i) result.ptr()[i] += bias_out.data.ptr()[i / count];
     return result;
 }
 
+Embedding::Embedding(size_t count, size_t dim, Net* net)
+: table(net->create_parameter(Tensor(dim, count), true)) {
+    table.randn();
+}
+
+Var Embedding::operator()(const Var& ids){
+    return autodiff::embedding(table, ids);
+}
+
+LayerNorm::LayerNorm(size_t features, Net* net, double eps_)
+: gamma(net->create_parameter(Tensor({{1, features, 1, 1}}, 1))),
+  beta(net->create_parameter(Tensor({{1, features, 1, 1}}, 0))),
+  eps(eps_) {}
+
+Var LayerNorm::operator()(const Var& input){
+    return autodiff::layer_norm(input, gamma, beta, eps);
+}
+
+// Each weight row is scaled so its largest magnitude maps to 127
+QuantizedLinear::QuantizedLinear(const FullyConnected& layer)
+: in_size(layer.weight.data.shape[0]), out_size(layer.weight.data.size / in_size),
+  padded((in_size + quant_block - 1) / quant_block * quant_block),
+  weight(out_size * padded, 0), scales(out_size), bias(out_size), sums(out_size, 0) {
+    auto w = layer.weight.data.ptr();
+    for(size_t o=0; o<out_size; ++o) {
+        double peak = 0;
+        for(size_t i=0; i<in_size; ++i) peak = std::max(peak, std::fabs(w[o * in_size + i]));
+        scales[o] = peak > 0 ? peak / int8_max : 1;
+        for(size_t i=0; i<in_size; ++i) {
+            auto q = static_cast<std::int8_t>(std::lround(w[o * in_size + i] / scales[o]));
+            weight[o * padded + i] = q;
+            sums[o] += q;
+        }
+        bias[o] = layer.bias.data.ptr()[o];
+    }
+}
+
+void QuantizedLinear::calibrate(const Tensor& input){
+    if(input.size != input.shape[0] * in_size) throw std::invalid_argument(quant_err);
+    for(size_t i=0; i<input.size; ++i) range = std::max(range, std::fabs(input.ptr()[i]));
+}
+
+// With x stored as x + 128, the int32 sums carry an extra 128 times the
+// sum of each weight row, which is taken off before scaling back
+Tensor QuantizedLinear::operator()(const Tensor& input) const{
+    auto batch = input.shape[0];
+    if(input.size != batch * in_size) throw std::invalid_argument(quant_err);
+    auto x = input.ptr();
+    auto limit = range;
+    if(limit == 0) {
+        for(size_t i=0; i<input.size; ++i) limit = std::max(limit, std::fabs(x[i]));
+    }
+    auto x_scale = limit > 0 ? limit / int8_max : 1;
+    // Samples become rows so each dot product runs over contiguous bytes
+    std::vector<std::uint8_t> q(batch * padded, static_cast<std::uint8_t>(input_offset));
+    for(size_t i=0; i<in_size; ++i) {
+        for(size_t b=0; b<batch; ++b) {
+            auto value = std::max(-int8_max, std::min(int8_max, std::round(x[i * batch + b] / x_scale)));
+            q[b * padded + i] = static_cast<std::uint8_t>(static_cast<std::int32_t>(value) + input_offset);
+        }
+    }
+    std::vector<std::int32_t> acc(out_size * batch);
+    qgemm(weight.data(), q.data(), out_size, padded, batch, acc.data());
+    Tensor result(batch, out_size);
+    auto out = result.ptr();
+    for(size_t o=0; o<out_size; ++o) {
+        auto scale = scales[o] * x_scale;
+        auto offset = input_offset * sums[o];
+        for(size_t b=0; b<batch; ++b) out[o * batch + b] = scale * (acc[o * batch + b] - offset) + bias[o];
+    }
+    return result;
+}
+
+QuantizedLinear::Accuracy QuantizedLinear::accuracy(FullyConnected& layer, const Tensor& input) const{
+    Tensor exact;
+    {
+        autodiff::NoGradGuard no_grad;
+        exact = layer(Var(input)).data;
+    }
+    auto approx = (*this)(input);
+    Accuracy report{0, 0, 0};
+    double error = 0, norm = 0;
+    for(size_t i=0; i<exact.size; ++i) {
+        auto diff = approx.ptr()[i] - exact.ptr()[i];
+        report.max_error = std::max(report.max_error, std::fabs(diff));
+        error += diff * diff;
+        norm += exact.ptr()[i] * exact.ptr()[i];
+    }
+    report.rms_error = std::sqrt(error / static_cast<double>(exact.size));
+    report.relative_error = norm > 0 ? std::sqrt(error / norm) : 0;
+    return report;
+}
+
 //Conv1d::Conv1d(Net* net, size_t c_in, size_t c_out, size_t kernel, size_t padding, size_t stride)
 //: weight(net, c_out, c_in, kernel, kernel), bias(net, c_out),
 // out_channels(c_out), kernel(kernel), padding(padding), stride(stride){
@@ -3,15 +3,157 @@
 #include "autodiff.hpp"
 #include "net.hpp"
 
+#include <cstdint>
+#include <vector>
+
 namespace nn{
 using autodiff::Var;
 
     class FullyConnected{
     private:
     Var &weight, &bias;
+    friend class BatchNorm;
+    friend class QuantizedLinear;
     public:
         FullyConnected(size_t, size_t, Net*);
         Var operator()(const Var&);
+        // A sparse batch, costing time in proportion to its entries
+        Var operator()(const SparseTensor&);
+    };
+
+    /**
+        BatchNorm
+        Normalises each feature over the batch, the columns of its input.
+        Running statistics are kept while training and used for inference.
+    */
+    class BatchNorm{
+    private:
+    Var &gamma, &beta;
+    Tensor running_mean, running_var;
+    // Per-row inference transform, off the tape and refreshed on each call
+    Var scale, shift;
+    double eps, momentum;
+    bool folded = false;
+    public:
+        // Training mode normalises with the batch statistics
+        bool training = true;
+        BatchNorm(size_t, Net*, double=1e-5, double=0.1);
+        Var operator()(const Var&);
+        // Folds the inference transform into the layer feeding this one,
+        // which then passes its input through unchanged
+        void fold(FullyConnected&);
+    };
+
+    /**
+        LSTM
+        A recurrent layer over a sequence of timesteps laid out as columns,
+        step t of sample b in column t * batch + b. Returns every hidden state.
+        The inputs of all steps are projected with one GEMM up front and each
+        step runs one GEMM over the stacked gate weights.
+    */
+    class LSTM{
+    private:
+    Var &weight_ih, &bias, &weight_hh;
+    public:
+        LSTM(size_t, size_t, Net*);
+        Var operator()(const Var&, size_t);
+    };
+
+    /**
+        GRU
+        A gated recurrent layer with the same layout as LSTM
+    */
+    class GRU{
+    private:
+    Var &weight_ih, &bias, &weight_hh;
+    public:
+        GRU(size_t, size_t, Net*);
+        Var operator()(const Var&, size_t);
+    };
+
+    /**
+        MultiHeadAttention
+        Self-attention over a sequence with one column per token. The
+        queries, keys and values come from one stacked projection and the
+        heads are merged by an output projection.
+    */
+    class MultiHeadAttention{
+    private:
+    Var &weight_qkv, &bias_qkv, &weight_out, &bias_out;
+    size_t heads;
+    // Keys and values of every token decoded so far, one column each with
+    // spare columns to grow into
+    Tensor keys, values;
+    size_t length = 0;
+    public:
+        MultiHeadAttention(size_t, size_t, Net*);
+        Var operator()(const Var&, bool=false);
+        // Runs the next tokens of a causal sequence against the cached keys
+        // and values of the earlier ones, adding their own to the cache.
+        // Each token costs time linear in the length decoded so far.
+        Tensor decode(const Tensor&);
+        // Empties the cache to start a new sequence
+        void reset_cache() { length = 0; }
+    };
+
+    /**
+        Embedding
+        A table with one row of features per id, looking up a column of ids
+        returns their rows as columns. Its gradient only holds the rows that
+        were looked up.
+    */
+    class Embedding{
+    private:
+    Var &table;
+    public:
+        Embedding(size_t, size_t, Net*);
+        Var operator()(const Var&);
+    };
+
+    /**
+        LayerNorm
+        Normalises the features of each column of its input
+    */
+    class LayerNorm{
+    private:
+    Var &gamma, &beta;
+    double eps;
+    public:
+        LayerNorm(size_t, Net*, double=1e-5);
+        Var operator()(const Var&);
+    };
+
+    /**
+        QuantizedLinear
+        Int8 copy of a FullyConnected layer for inference. Each output
+        channel of the weight gets its own scale, and the inputs share one
+        calibrated from sample batches, or taken from each batch until then.
+        Products accumulate in int32 and are scaled back to doubles before
+        the bias is added. Later changes to the source layer aren't seen.
+    */
+    class QuantizedLinear{
+    private:
+    size_t in_size, out_size, padded;
+    std::vector<std::int8_t> weight;
+    std::vector<double> scales, bias;
+    // Sum of each weight row, cancels the offset the inputs are stored with
+    std::vector<std::int32_t> sums;
+    double range = 0;
+    public:
+        /**
+            Accuracy
+            Error of the int8 path against the double one over a batch, the
+            relative error is the RMS error over the RMS of the exact output
+        */
+        struct Accuracy {
+            double max_error, rms_error, relative_error;
+        };
+
+        explicit QuantizedLinear(const FullyConnected&);
+        // Widens the calibrated input range to cover a sample batch
+        void calibrate(const Tensor&);
+        Tensor operator()(const Tensor&) const;
+        Accuracy accuracy(FullyConnected&, const Tensor&) const;
     };
 
 //   class Conv1d{
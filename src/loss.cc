@@ -9,6 +9,7 @@ using nn::Tensor;
 using std::invalid_argument;
 
 static std::string size_mismatch = "The sizes of the input and the target do not match"; 
+static std::string label_mismatch = "There must be one label for each column of the input";
 
 Var l1_loss(Var& input, Var& target) {
     if (input.data.shape != target.data.shape) throw invalid_argument(size_mismatch);
@@ -32,9 +33,11 @@ Var mean_squared_error(Var& input, Var& target) {
     return loss;
 }
 
-Var cross_entropy_loss(Var& input, Var& target) {
-    if (input.data.shape != target.data.shape) throw invalid_argument(size_mismatch);    
-    auto loss = -1 * (input * log(target)).sum();
+// The input holds the logits of each sample as a column, the softmax is
+// fused into the loss so no probabilities are formed on the forward pass
+Var cross_entropy_loss(Var& input, Var& labels) {
+    if (labels.size() != input.data.shape[0]) throw invalid_argument(label_mismatch);
+    auto loss = autodiff::cross_entropy(input, labels);
     return loss;
 }
 
@@ -7,6 +7,7 @@ using autodiff::Var;
 Var l1_loss(Var&, Var&);
 Var mean_error(Var&, Var&);
 Var mean_squared_error(Var&, Var&);
+// Softmax cross-entropy of logits against the class index of each column
 Var cross_entropy_loss(Var&, Var&);
 } // namepsace loss
 
@@ -1,7 +1,101 @@
 #include "net.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
 namespace nn{
+
+// Doubles per cache line
+static const size_t line = 64 / sizeof(double);
+
+Net::~Net(){
+    autodiff::release_leaves(parameters, grads.start, grads.start + capacity);
+}
+
 void Net::backward(const autodiff::Var& loss){
     loss.evaluate_leaves();
 }
+
+void Net::zero_grad(){
+    autodiff::reset_tape();
+}
+
+void Net::Arena::allocate(size_t n){
+    memory.reset(new double[n + line]());
+    auto offset = reinterpret_cast<std::uintptr_t>(memory.get()) / sizeof(double) % line;
+    start = memory.get() + (offset ? line - offset : 0);
+}
+
+// Grows geometrically so building a net moves each value a constant number
+// of times on average
+void Net::reserve(size_t n){
+    if(n <= capacity) return;
+    capacity = std::max(n, 2 * capacity);
+    Arena new_values, new_grads;
+    new_values.allocate(capacity);
+    new_grads.allocate(capacity);
+    if(used) {
+        std::copy(values.start, values.start + used, new_values.start);
+        std::copy(grads.start, grads.start + used, new_grads.start);
+    }
+    for(auto parameter : dense) {
+        auto offset = static_cast<size_t>(parameter->data.ptr() - values.start);
+        parameter->data.bind(new_values.start + offset, parameter->data.shape);
+        parameter->bind_grad(new_grads.start + offset);
+    }
+    values = std::move(new_values);
+    grads = std::move(new_grads);
+}
+
+Var& Net::create_parameter(const Tensor& data, bool sparse){
+    parameters.push_front(Var(data));
+    auto &parameter = parameters.front();
+    parameter.set_requires_grad();
+    if(sparse) parameter.set_sparse_grad();
+    else {
+        reserve(used + data.size);
+        std::copy(data.ptr(), data.ptr() + data.size, values.start + used);
+        parameter.data.bind(values.start + used, data.shape);
+        parameter.bind_grad(grads.start + used);
+        used += data.size;
+        dense.push_back(&parameter);
+    }
+    autodiff::keep_tape();
+    return parameter;
+}
+
+Tensor Net::flat_params(){
+    return Tensor(values.start, {{used, 1, 1, 1}});
+}
+
+Tensor Net::flat_grad(){
+    return Tensor(grads.start, {{used, 1, 1, 1}});
+}
+
+double Net::grad_norm(){
+    double total = 0;
+    auto g = grads.start;
+    for(size_t i=0; i<used; ++i) total += g[i] * g[i];
+    for(auto &parameter : parameters) {
+        if(auto rows = parameter.row_grad()) {
+            for(auto value : rows->values) total += value * value;
+        }
+    }
+    return std::sqrt(total);
+}
+
+double Net::clip_grad_norm(double max_norm){
+    auto norm = grad_norm();
+    if(norm <= max_norm) return norm;
+    auto scale = max_norm / norm;
+    auto g = grads.start;
+    for(size_t i=0; i<used; ++i) g[i] *= scale;
+    for(auto &parameter : parameters) {
+        if(auto rows = parameter.row_grad()) {
+            for(auto &value : rows->values) value *= scale;
+        }
+    }
+    return norm;
+}
 } // namespace nn
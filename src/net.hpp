@@ -1,7 +1,10 @@
 #ifndef NET_H
 #define NET_H
 #include "autodiff.hpp"
+#include "graph.hpp"
 #include <forward_list>
+#include <memory>
+#include <vector>
 
 namespace nn{
 using autodiff::Var;
@@ -13,16 +16,49 @@ using autodiff::Var;
 */
 class Net{    
     public:
+    // Parameters outlive the net on the tape, their gradients are handed back
+    // their own memory
+    virtual ~Net();
     // Backpropigation using the chain rule and the AutoDiff module
     void backward(const Var &loss);
-    // Parameter registration and creation
-    Var& create_parameter(const Tensor& data) {
-        parameters.push_front(Var(data));
-        return parameters.front();
-    }
+    // Clears the tape back to the parameters of the nets on this thread and
+    // zeroes their gradients. Should be called once per training step, after
+    // the optimiser.
+    void zero_grad();
+    // Parameter registration and creation. Dense parameters live side by
+    // side in one arena and their gradients in another, sparse ones keep
+    // their own table and take row gradients.
+    Var& create_parameter(const Tensor& data, bool sparse=false);
     std::forward_list<Var>& params() { return parameters; }
+    // Views of every dense parameter, and of their gradients, as one flat tensor
+    Tensor flat_params();
+    Tensor flat_grad();
+    // L2 norm of the gradient of every parameter
+    double grad_norm();
+    // Scales the gradients so their norm is at most max_norm, returns the norm before clipping
+    double clip_grad_norm(double max_norm);
+    // Captures fn as a replayable graph bound to the net's parameters
+    autodiff::Graph capture(const std::vector<Var*>& inputs, const std::function<Var()>& fn) {
+        return autodiff::Graph(inputs, parameters, fn);
+    }
     protected:
     std::forward_list<Var> parameters;
+    private:
+    /**
+        Arena
+        Zeroed memory starting on a cache line, parameters are carved out of it in order
+    */
+    struct Arena {
+        std::unique_ptr<double[]> memory;
+        double* start = nullptr;
+        void allocate(size_t);
+    };
+    Arena values, grads;
+    size_t used = 0, capacity = 0;
+    // Dense parameters in the order they sit in the arenas
+    std::vector<Var*> dense;
+    // Moves the arenas to room for at least n values, rebinding every parameter
+    void reserve(size_t n);
 };
 } // namespace nn
 #endif // NET_H
@@ -1,32 +1,192 @@
 #include "optim.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
 namespace opt{
+
+// The update kernels below are flat loops over one stretch of a parameter,
+// its gradient and its state. Nothing aliases so they vectorise, and each
+// element is read and written once per step.
+
+static void gd_kernel(double* __restrict p, const double* __restrict g, size_t n, double l_rate) {
+    for(size_t i=0; i<n; ++i) p[i] -= l_rate * g[i];
+}
+
+static void moment_kernel(double* __restrict p, const double* __restrict g, double* __restrict m, size_t n,
+                          double l_rate, double moment) {
+    for(size_t i=0; i<n; ++i) {
+        m[i] = moment * m[i] + l_rate * g[i];
+        p[i] -= m[i];
+    }
+}
+
+// step_size and root_correction fold the bias corrections of the two
+// moments into the learning rate and the denominator
+static void adam_kernel(double* __restrict p, const double* __restrict g, double* __restrict m, double* __restrict v,
+                        size_t n, double step_size, double root_correction, double beta_1, double beta_2, double eps,
+                        double l2, double shrink) {
+    for(size_t i=0; i<n; ++i) {
+        auto grad = g[i] + l2 * p[i];
+        m[i] = beta_1 * m[i] + (1 - beta_1) * grad;
+        v[i] = beta_2 * v[i] + (1 - beta_2) * grad * grad;
+        p[i] = p[i] * shrink - step_size * m[i] / (std::sqrt(v[i]) * root_correction + eps);
+    }
+}
+
+static void rms_kernel(double* __restrict p, const double* __restrict g, double* __restrict v, size_t n,
+                       double l_rate, double alpha, double eps) {
+    for(size_t i=0; i<n; ++i) {
+        v[i] = alpha * v[i] + (1 - alpha) * g[i] * g[i];
+        p[i] -= l_rate * g[i] / (std::sqrt(v[i]) + eps);
+    }
+}
+
+// Dense parameters laid side by side, as a Net lays them out, keep their
+// state at the same offsets so that all of them form one stretch. Other
+// parameters have their state appended in list order.
 Opt::Opt(ParameterList& parameters_)
-: parameters(parameters_){}
+: parameters(parameters_){
+    std::vector<std::pair<double*, size_t>> spans;
+    for(auto &it : parameters) {
+        if(!it.row_grad()) spans.emplace_back(it.data.ptr(), it.data.size);
+    }
+    std::sort(spans.begin(), spans.end());
+    auto tiles = !spans.empty();
+    for(size_t k=1; k<spans.size(); ++k) tiles = tiles && spans[k-1].first + spans[k-1].second == spans[k].first;
+    if(tiles) {
+        base = spans.front().first;
+        tiled_size = static_cast<size_t>(spans.back().first - base) + spans.back().second;
+        state_size = tiled_size;
+    }
+    for(auto &it : parameters) {
+        auto rows = it.row_grad();
+        first_rows.push_back(sparse_rows);
+        if(rows) sparse_rows += it.data.size / rows->width;
+        if(tiles && !rows) offsets.push_back(static_cast<size_t>(it.data.ptr() - base));
+        else {
+            offsets.push_back(state_size);
+            state_size += it.data.size;
+        }
+    }
+}
+
+const double* Opt::tiled_grads() const {
+    if(!base) return nullptr;
+    const double* grads = nullptr;
+    size_t k = 0;
+    for(auto &it : parameters) {
+        auto offset = offsets[k++];
+        if(it.row_grad()) continue;
+        auto grad = it.grad_view();
+        if(!grad || it.data.ptr() != base + offset) return nullptr;
+        if(!grads) grads = grad->ptr() - offset;
+        else if(grad->ptr() != grads + offset) return nullptr;
+    }
+    return grads;
+}
+
+// A stretch is the whole arena, a whole parameter or one touched row of a
+// sparse one
+template<typename Update>
+void Opt::sweep(Update update) const {
+    auto grads = tiled_grads();
+    if(grads) update(Stretch{base, grads, tiled_size, 0, 0, false});
+    size_t k = 0;
+    for(auto &it : parameters) {
+        auto offset = offsets[k];
+        auto row = first_rows[k++];
+        if(auto rows = it.row_grad()) {
+            for(size_t r=0; r<rows->rows.size(); ++r) {
+                auto at = rows->rows[r] * rows->width;
+                update(Stretch{it.data.ptr() + at, rows->values.data() + r * rows->width, rows->width,
+                               offset + at, row + rows->rows[r], true});
+            }
+        }
+        else if(!grads) {
+            if(auto grad = it.grad_view()) update(Stretch{it.data.ptr(), grad->ptr(), it.data.size, offset, 0, false});
+        }
+    }
+}
 
 GD::GD(ParameterList& parameters, double l_rate_)
 : Opt(parameters), l_rate(l_rate_){}
 
 void GD::step(){
-    for(auto &it : parameters){
-        auto parameter_update = it.grad() * l_rate;
-        it -= parameter_update;
-    }
+    // Updated in place so the parameters keep their leaves on the tape
+    sweep([&](const Stretch& s) { gd_kernel(s.values, s.grad, s.size, l_rate); });
 }
 
 Moment::Moment(ParameterList& parameters, double l_rate_, double moment_)
-: Opt(parameters), l_rate(l_rate_), moment(moment_){
-    for(auto &it : parameters){
-        m_list.push_back(nn::Tensor(it.data.shape, 0));
-    }
-}
+: Opt(parameters), l_rate(l_rate_), moment(moment_), momentum({{state_size, 1, 1, 1}}, 0), last(sparse_rows, 0){}
 
+// A row skipping k steps would have had its momentum m decay to moment^k m
+// while moving by m (moment + ... + moment^k), both are applied at once
 void Moment::step(){
-    auto p_it = parameters.begin();
-    for(auto &m_it : m_list){
-        m_it = moment * m_it + l_rate * (*p_it).grad();
-        *p_it -= m_it;
-        ++p_it;
-    }
+    ++steps;
+    sweep([&](const Stretch& s) {
+        auto m = momentum.ptr() + s.offset;
+        if(s.sparse) {
+            auto skipped = static_cast<double>(steps - 1 - last[s.row]);
+            auto decay = std::pow(moment, skipped);
+            auto travel = moment == 1 ? skipped : moment * (1 - decay) / (1 - moment);
+            for(size_t i=0; i<s.size; ++i) {
+                s.values[i] -= travel * m[i];
+                m[i] *= decay;
+            }
+            last[s.row] = steps;
+        }
+        moment_kernel(s.values, s.grad, m, s.size, l_rate, moment);
+    });
+}
+
+Opt::State Moment::state(){
+    State state;
+    state.buffers = {&momentum};
+    state.counters = {{&steps, 1}, {last.data(), last.size()}};
+    return state;
+}
+
+Adam::Adam(ParameterList& parameters_, double l_rate_, double beta_1_, double beta_2_, double eps_, double decay_)
+: Opt(parameters_), l_rate(l_rate_), beta_1(beta_1_), beta_2(beta_2_), eps(eps_), decay(decay_),
+  first({{state_size, 1, 1, 1}}, 0), second({{state_size, 1, 1, 1}}, 0){}
+
+void Adam::step(){
+    ++steps;
+    auto t = static_cast<double>(steps);
+    auto step_size = l_rate / (1 - std::pow(beta_1, t));
+    auto root_correction = 1 / std::sqrt(1 - std::pow(beta_2, t));
+    auto l2 = decoupled ? 0 : decay;
+    auto shrink = decoupled ? 1 - l_rate * decay : 1;
+    sweep([&](const Stretch& s) {
+        adam_kernel(s.values, s.grad, first.ptr() + s.offset, second.ptr() + s.offset, s.size, step_size,
+                    root_correction, beta_1, beta_2, eps, l2, shrink);
+    });
+}
+
+Opt::State Adam::state(){
+    State state;
+    state.buffers = {&first, &second};
+    state.counters = {{&steps, 1}};
+    return state;
+}
+
+AdamW::AdamW(ParameterList& parameters_, double l_rate_, double beta_1_, double beta_2_, double eps_, double decay_)
+: Adam(parameters_, l_rate_, beta_1_, beta_2_, eps_, decay_){
+    decoupled = true;
+}
+
+RMSProp::RMSProp(ParameterList& parameters_, double l_rate_, double alpha_, double eps_)
+: Opt(parameters_), l_rate(l_rate_), alpha(alpha_), eps(eps_), square({{state_size, 1, 1, 1}}, 0){}
+
+void RMSProp::step(){
+    sweep([&](const Stretch& s) { rms_kernel(s.values, s.grad, square.ptr() + s.offset, s.size, l_rate, alpha, eps); });
+}
+
+Opt::State RMSProp::state(){
+    State state;
+    state.buffers = {&square};
+    return state;
 }
 } // namespace opt
@@ -2,7 +2,8 @@
 #define OPTIM_H
 
 #include "net.hpp"
-#include <list>
+#include <utility>
+#include <vector>
 
 namespace opt{
 
@@ -11,15 +12,62 @@ typedef std::forward_list<Var> ParameterList;
 
 /**
     Opt
-    Abstract optimiser storing a reference to a list of autodiff::Vars
+    Abstract optimiser storing a reference to a list of autodiff::Vars.
+    Each step updates a parameter and its state in one pass over memory,
+    reading the gradient in place on the tape. Dense parameters that tile
+    a Net's arena are updated together in a single pass. Parameters no
+    backward pass reached are left alone, those with sparse gradients only
+    have their touched rows updated.
 */
 class Opt{
 public:
+    /**
+        State
+        Everything an optimiser carries from one step to the next, as
+        buffers of values and runs of counters it can be saved from and
+        restored into
+    */
+    struct State {
+        std::vector<nn::Tensor*> buffers;
+        std::vector<std::pair<size_t*, size_t>> counters;
+    };
+
     Opt(ParameterList&);
     virtual void step(){}
+    virtual State state() { return State(); }
     virtual ~Opt(){}
 protected:
+    /**
+        Stretch
+        A run of parameter values with their gradient and its offset into
+        the optimiser state. A row of a sparse parameter also has its index
+        among the rows of every sparse parameter.
+    */
+    struct Stretch {
+        double* values;
+        const double* grad;
+        size_t size, offset, row;
+        bool sparse;
+    };
+
     ParameterList& parameters;
+    // Values of state per state tensor and rows of sparse parameters
+    size_t state_size = 0, sparse_rows = 0;
+
+    // Calls update on every stretch with a gradient
+    template<typename Update>
+    void sweep(Update) const;
+private:
+    // Offset of each parameter into the state and its first sparse row
+    std::vector<size_t> offsets, first_rows;
+    // Start and size of the arena the dense parameters tiled when the
+    // optimiser was made, their state is laid out the same way
+    double* base = nullptr;
+    size_t tiled_size = 0;
+
+    // Start of the gradients if the dense parameters and their gradients
+    // still tile an arena each, null otherwise
+    const double* tiled_grads() const;
 };
 
 /**
@@ -38,17 +86,71 @@ private:
 
 /**
     Moment
-    Gradient descent optimisation of a ParameterList with momentum
+    Gradient descent optimisation of a ParameterList with momentum.
+    Rows of a parameter with a sparse gradient are updated lazily, a row
+    catches up on the momentum it would have moved by since its last update
+    when it is next touched.
 */
 class Moment : public Opt{
 public:
     Moment(ParameterList&, double = 0.1, double = 0.9);
     // One optimisation step
     void step();
+    State state();
     ~Moment(){}
 private:
     double l_rate, moment;
-    std::list<nn::Tensor> m_list;
+    nn::Tensor momentum;
+    // Step each row of a sparse parameter was last updated at
+    std::vector<size_t> last;
+    size_t steps = 0;
+};
+
+/**
+    Adam
+    Adaptive moment estimation with bias corrected first and second moments.
+    Weight decay is added to the gradient as an L2 penalty.
+*/
+class Adam : public Opt{
+public:
+    Adam(ParameterList&, double = 1e-3, double = 0.9, double = 0.999, double = 1e-8, double = 0);
+    // One optimisation step
+    void step();
+    State state();
+    ~Adam(){}
+protected:
+    // Whether weight decay shrinks the parameters directly, as in AdamW
+    bool decoupled = false;
+private:
+    double l_rate, beta_1, beta_2, eps, decay;
+    nn::Tensor first, second;
+    size_t steps = 0;
+};
+
+/**
+    AdamW
+    Adam with weight decay decoupled from the gradient, the parameters are
+    shrunk by the learning rate times the decay on every step
+*/
+class AdamW : public Adam{
+public:
+    AdamW(ParameterList&, double = 1e-3, double = 0.9, double = 0.999, double = 1e-8, double = 1e-2);
+};
+
+/**
+    RMSProp
+    Gradient descent scaled by a running average of the squared gradient
+*/
+class RMSProp : public Opt{
+public:
+    RMSProp(ParameterList&, double = 1e-2, double = 0.99, double = 1e-8);
+    // One optimisation step
+    void step();
+    State state();
+    ~RMSProp(){}
+private:
+    double l_rate, alpha, eps;
+    nn::Tensor square;
 };
 
 } // namespace opt
@@ -0,0 +1,416 @@
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif // __linux__
+
+namespace nn {
+
+// Values summed across the replicas at a time, small enough that the running
+// sum stays in cache while every replica is added to it
+static const size_t block = 2048;
+
+// Doubles per cache line, chunks start on one so workers never share a line
+static const size_t line = 64 / sizeof(double);
+
+Barrier::Barrier(size_t count_) : count(count_) {}
+
+void Barrier::wait() {
+    std::unique_lock<std::mutex> held(lock);
+    auto arrived = generation;
+    if(++waiting == count) {
+        waiting = 0;
+        ++generation;
+        released.notify_all();
+        return;
+    }
+    released.wait(held, [&]{ return generation != arrived; });
+}
+
+DataParallel::DataParallel(size_t n, const Factory& factory, const Optimiser& make_optimiser)
+: replicas(n), sparse(n), rows(n), losses(n), errors(n), edge(n + 1), phase(n) {
+    if(n == 0) throw std::invalid_argument("Data parallel training needs at least one worker");
+    for(size_t w=0; w<n; ++w) {
+        workers.emplace_back([this, w, &factory, &make_optimiser]{ work(w, factory, make_optimiser); });
+    }
+    // Waits for every replica to be built and synchronised
+    edge.wait();
+    if(failed()) {
+        auto error = *std::find_if(errors.begin(), errors.end(), [](const std::exception_ptr& e){ return e; });
+        stopping = true;
+        edge.wait();
+        for(auto &worker : workers) worker.join();
+        std::rethrow_exception(error);
+    }
+}
+
+DataParallel::~DataParallel() {
+    stopping = true;
+    edge.wait();
+    for(auto &worker : workers) worker.join();
+}
+
+bool DataParallel::failed() const {
+    return std::any_of(errors.begin(), errors.end(), [](const std::exception_ptr& e){ return static_cast<bool>(e); });
+}
+
+double DataParallel::step(const Shard& fn) {
+    shard = &fn;
+    edge.wait();
+    edge.wait();
+    shard = nullptr;
+    for(auto &error : errors) {
+        if(!error) continue;
+        auto first = error;
+        std::fill(errors.begin(), errors.end(), nullptr);
+        std::rethrow_exception(first);
+    }
+    double total = 0;
+    for(auto loss : losses) total += loss;
+    return total / static_cast<double>(size());
+}
+
+// Each phase ends at a barrier, so every worker sees the others' results
+// and errors. A worker that failed keeps meeting the barriers so the rest
+// don't stall, the later phases are skipped for all of them.
+void DataParallel::work(size_t w, const Factory& factory, const Optimiser& make_optimiser) {
+    try {
+        replicas[w] = factory();
+        for(auto &parameter : replicas[w]->params()) {
+            if(parameter.row_grad()) sparse[w].push_back(&parameter);
+        }
+        if(w == 0) optimiser = make_optimiser(*replicas[0]);
+    }
+    catch(...) {
+        errors[w] = std::current_exception();
+    }
+    phase.wait();
+    if(w && !failed()) broadcast(w, true);
+    edge.wait();
+    while(true) {
+        edge.wait();
+        if(stopping) break;
+        auto &net = *replicas[w];
+        try {
+            auto loss = (*shard)(net, w);
+            losses[w] = loss.data.ptr()[0];
+            net.backward(loss);
+            // Row gradients sit on this thread's tape, so are looked up here
+            rows[w].clear();
+            for(auto parameter : sparse[w]) rows[w].push_back(parameter->row_grad());
+        }
+        catch(...) {
+            errors[w] = std::current_exception();
+        }
+        phase.wait();
+        if(!failed()) reduce(w);
+        phase.wait();
+        if(w == 0 && !failed()) {
+            try {
+                merge();
+                optimiser->step();
+            }
+            catch(...) {
+                errors[0] = std::current_exception();
+            }
+        }
+        phase.wait();
+        if(w && !failed()) broadcast(w, false);
+        phase.wait();
+        net.zero_grad();
+        edge.wait();
+    }
+    // Parameters release their tape entries on the thread that recorded them
+    if(w == 0) optimiser.reset();
+    replicas[w].reset();
+}
+
+// A reduce-scatter through shared memory, worker w owns chunk w of the
+// gradient arena and leaves the mean over the replicas in the first one
+void DataParallel::reduce(size_t w) {
+    auto n = replicas[0]->flat_grad().size;
+    auto chunk = (n / size() + line) / line * line;
+    auto begin = std::min(n, w * chunk);
+    auto end = std::min(n, begin + chunk);
+    auto scale = 1 / static_cast<double>(size());
+    std::vector<const double*> grads;
+    for(size_t r=1; r<size(); ++r) grads.push_back(replicas[r]->flat_grad().ptr());
+    auto sum = replicas[0]->flat_grad().ptr();
+    for(size_t b0=begin; b0<end; b0+=block) {
+        auto b1 = std::min(end, b0 + block);
+        for(auto g : grads) {
+            for(size_t i=b0; i<b1; ++i) sum[i] += g[i];
+        }
+        for(size_t i=b0; i<b1; ++i) sum[i] *= scale;
+    }
+}
+
+// Row gradients are merged into the first replica's by the first worker
+void DataParallel::merge() {
+    auto scale = 1 / static_cast<double>(size());
+    for(size_t k=0; k<rows[0].size(); ++k) {
+        auto &target = *rows[0][k];
+        for(size_t r=1; r<size(); ++r) {
+            auto &source = *rows[r][k];
+            for(size_t e=0; e<source.rows.size(); ++e) {
+                target.add(source.rows[e], source.values.data() + e * source.width, 1);
+            }
+        }
+        for(auto &value : target.values) value *= scale;
+    }
+}
+
+// Copies the first replica's parameters into replica w, only the rows the
+// step touched of a sparse table unless everything is
+void DataParallel::broadcast(size_t w, bool everything) {
+    auto from = replicas[0]->flat_params();
+    std::copy(from.ptr(), from.ptr() + from.size, replicas[w]->flat_params().ptr());
+    for(size_t k=0; k<sparse[0].size(); ++k) {
+        auto &source = sparse[0][k]->data;
+        auto target = sparse[w][k]->data.ptr();
+        if(everything) {
+            std::copy(source.ptr(), source.ptr() + source.size, target);
+            continue;
+        }
+        auto width = source.shape[0];
+        for(auto row : rows[0][k]->rows) {
+            std::copy(source.ptr() + row * width, source.ptr() + (row + 1) * width, target + row * width);
+        }
+    }
+}
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Restricts the calling thread to a set of cores, which is left as it is
+// where thread affinity isn't supported
+static void pin(const std::vector<int>& cores) {
+#ifdef __linux__
+    if(cores.empty()) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(auto core : cores) {
+        if(core < 0 || core >= CPU_SETSIZE) throw std::invalid_argument("Pipeline stages can only be pinned to existing cores");
+        CPU_SET(core, &set);
+    }
+    if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+        throw std::runtime_error("Could not pin a pipeline stage to its cores");
+    }
+#else
+    (void)cores;
+#endif // __linux__
+}
+
+Channel::Channel(size_t capacity_) : capacity(capacity_) {
+    if(capacity == 0) throw std::invalid_argument("Channels need room for at least one tensor");
+}
+
+void Channel::push(Tensor&& item) {
+    std::unique_lock<std::mutex> held(lock);
+    changed.wait(held, [&]{ return closed || items.size() < capacity; });
+    if(closed) throw std::logic_error("Pushed to a closed channel");
+    items.push_back(std::move(item));
+    changed.notify_all();
+}
+
+Tensor Channel::pop() {
+    std::unique_lock<std::mutex> held(lock);
+    changed.wait(held, [&]{ return closed || !items.empty(); });
+    if(closed) throw std::logic_error("Popped from a closed channel");
+    auto item = std::move(items.front());
+    items.pop_front();
+    changed.notify_all();
+    return item;
+}
+
+void Channel::close() {
+    std::lock_guard<std::mutex> held(lock);
+    closed = true;
+    changed.notify_all();
+}
+
+void Channel::reset() {
+    std::lock_guard<std::mutex> held(lock);
+    items.clear();
+    closed = false;
+}
+
+double Pipeline::Timing::bubble() const {
+    if(elapsed <= 0 || busy.empty()) return 0;
+    double total = 0;
+    for(auto b : busy) total += b;
+    return std::max(0.0, 1 - total / (elapsed * static_cast<double>(busy.size())));
+}
+
+Pipeline::Pipeline(const std::vector<Stage>& stages_, const Optimiser& make_optimiser, size_t capacity)
+: stages(stages_), nets(stages_.size()), optimisers(stages_.size()), edge(stages_.size() + 1), phase(stages_.size()) {
+    auto n = stages.size();
+    if(n == 0) throw std::invalid_argument("A pipeline needs at least one stage");
+    if(capacity == 0) capacity = n;
+    for(size_t s=1; s<n; ++s) {
+        forward.emplace_back(new Channel(capacity));
+        backward.emplace_back(new Channel(capacity));
+    }
+    timings.busy.assign(n, 0);
+    timings.waiting.assign(n, 0);
+    for(size_t s=0; s<n; ++s) {
+        workers.emplace_back([this, s, &make_optimiser]{ work(s, make_optimiser); });
+    }
+    // Waits for every stage to be built
+    edge.wait();
+    if(failed()) {
+        stopping = true;
+        edge.wait();
+        for(auto &worker : workers) worker.join();
+        std::rethrow_exception(error);
+    }
+}
+
+Pipeline::~Pipeline() {
+    stopping = true;
+    edge.wait();
+    for(auto &worker : workers) worker.join();
+}
+
+double Pipeline::step(const std::vector<Tensor>& micro_batches) {
+    if(micro_batches.empty()) throw std::invalid_argument("A pipeline step needs at least one micro-batch");
+    batches = &micro_batches;
+    losses.assign(micro_batches.size(), 0);
+    auto start = Clock::now();
+    edge.wait();
+    edge.wait();
+    timings.elapsed = seconds_since(start);
+    batches = nullptr;
+    if(error) {
+        auto first = error;
+        error = nullptr;
+        for(auto &channel : forward) channel->reset();
+        for(auto &channel : backward) channel->reset();
+        std::rethrow_exception(first);
+    }
+    double total = 0;
+    for(auto loss : losses) total += loss;
+    return total / static_cast<double>(losses.size());
+}
+
+// Keeps the first error and closes every channel, so stages blocked on one
+// throw in turn and reach the end of the step
+void Pipeline::fail(std::exception_ptr e) {
+    std::lock_guard<std::mutex> held(lock);
+    if(!error) error = e;
+    for(auto &channel : forward) channel->close();
+    for(auto &channel : backward) channel->close();
+}
+
+bool Pipeline::failed() {
+    std::lock_guard<std::mutex> held(lock);
+    return static_cast<bool>(error);
+}
+
+// The optimisers only step once every stage has finished its micro-batches,
+// so a failure anywhere leaves all the parameters as they were
+void Pipeline::work(size_t s, const Optimiser& make_optimiser) {
+    try {
+        pin(stages[s].cores);
+        nets[s] = stages[s].build();
+        optimisers[s] = make_optimiser(*nets[s]);
+    }
+    catch(...) {
+        fail(std::current_exception());
+    }
+    edge.wait();
+    while(true) {
+        edge.wait();
+        if(stopping) break;
+        try {
+            run(s);
+        }
+        catch(...) {
+            fail(std::current_exception());
+        }
+        phase.wait();
+        if(!failed()) {
+            auto start = Clock::now();
+            try {
+                optimisers[s]->step();
+            }
+            catch(...) {
+                fail(std::current_exception());
+            }
+            timings.busy[s] += seconds_since(start);
+        }
+        nets[s]->zero_grad();
+        edge.wait();
+    }
+    // Parameters release their tape entries on the thread that recorded them
+    optimisers[s].reset();
+    nets[s].reset();
+}
+
+// Forward passes are queued until their gradient comes back, oldest first.
+// A stage that isn't first takes its input as a leaf, so its gradient can
+// be sent upstream once the stage's own backward pass reaches it.
+void Pipeline::run(size_t s) {
+    auto &stage = stages[s];
+    auto &net = *nets[s];
+    auto n = size(), m = batches->size();
+    auto first = s == 0, last = s + 1 == n;
+    auto &busy = timings.busy[s], &waiting = timings.waiting[s];
+    busy = waiting = 0;
+    std::deque<std::pair<Var, Var>> flight;
+
+    auto forward_pass = [&](size_t i) {
+        auto start = Clock::now();
+        auto x = first ? (*batches)[i] : forward[s - 1]->pop();
+        waiting += seconds_since(start);
+        start = Clock::now();
+        Var input(x);
+        if(!first) input.set_requires_grad();
+        auto output = stage.forward(net, input, i);
+        if(last) losses[i] = output.data.ptr()[0];
+        flight.emplace_back(input, output);
+        busy += seconds_since(start);
+        if(last) return;
+        start = Clock::now();
+        forward[s]->push(Tensor(output.data));
+        waiting += seconds_since(start);
+    };
+    auto backward_pass = [&]() {
+        auto start = Clock::now();
+        auto &output = flight.front().second;
+        // The last stage scales each loss so the gradients add up to those of the mean
+        auto seed = last ? Tensor(output.data.shape, 1 / static_cast<double>(m)) : backward[s]->pop();
+        waiting += seconds_since(start);
+        start = Clock::now();
+        output.evaluate_leaves(seed);
+        Tensor g;
+        if(!first) g = flight.front().first.grad();
+        // Its nodes stay on the tape until the step ends, but not their activations
+        autodiff::release_graph(flight.front().first, output);
+        flight.pop_front();
+        busy += seconds_since(start);
+        if(first) return;
+        start = Clock::now();
+        backward[s - 1]->push(std::move(g));
+        waiting += seconds_since(start);
+    };
+
+    // Stage s runs ahead by the number of stages after it, which is how many
+    // micro-batches are in flight downstream when its first gradient returns
+    auto warmup = std::min(n - s - 1, m);
+    for(size_t i=0; i<warmup; ++i) forward_pass(i);
+    for(size_t i=warmup; i<m; ++i) {
+        forward_pass(i);
+        backward_pass();
+    }
+    while(!flight.empty()) backward_pass();
+}
+
+} // namespace nn
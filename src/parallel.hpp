@@ -0,0 +1,195 @@
+/**
+    Parallel
+    Synchronous data-parallel and pipeline-parallel training of nets on
+    worker threads
+ */
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include "net.hpp"
+#include "optim.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nn {
+
+/**
+    Barrier
+    Holds each thread calling wait until a fixed number of them have
+    arrived, then releases them all and starts over
+*/
+class Barrier {
+public:
+    explicit Barrier(size_t);
+    void wait();
+private:
+    std::mutex lock;
+    std::condition_variable released;
+    size_t count, waiting = 0, generation = 0;
+};
+
+/**
+    DataParallel
+    Trains one replica of a net per worker thread. Each replica is built on
+    its own worker, so it records onto that thread's tape, and runs the
+    forward and backward pass of one shard of every batch. The gradients
+    are then averaged into the first replica, each worker summing one
+    contiguous chunk of the arenas across all replicas, the optimiser of
+    the first replica steps once and the other replicas copy the updated
+    parameters back.
+*/
+class DataParallel {
+public:
+    typedef std::function<std::unique_ptr<Net>()> Factory;
+    // Builds the optimiser of the first replica
+    typedef std::function<std::unique_ptr<opt::Opt>(Net&)> Optimiser;
+    // Loss of a replica on the numbered shard of the batch
+    typedef std::function<Var(Net&, size_t)> Shard;
+
+    DataParallel(size_t, const Factory&, const Optimiser&);
+    ~DataParallel();
+    DataParallel(const DataParallel&) = delete;
+    DataParallel& operator=(const DataParallel&) = delete;
+
+    // One synchronous step over a shard per worker, returns the mean loss
+    // Rethrows the first exception a worker threw, the step is then skipped
+    double step(const Shard&);
+
+    // The first replica, which holds the trained parameters. Other threads
+    // may only run it under a NoGradGuard, between steps.
+    Net& model() { return *replicas[0]; }
+    size_t size() const { return workers.size(); }
+
+private:
+    void work(size_t, const Factory&, const Optimiser&);
+    void reduce(size_t);
+    void merge();
+    void broadcast(size_t, bool);
+    bool failed() const;
+
+    std::vector<std::unique_ptr<Net>> replicas;
+    std::unique_ptr<opt::Opt> optimiser;
+    // Sparse parameters of each replica and their row gradients in the current step
+    std::vector<std::vector<Var*>> sparse;
+    std::vector<std::vector<autodiff::RowGrad*>> rows;
+    std::vector<double> losses;
+    std::vector<std::exception_ptr> errors;
+    const Shard* shard = nullptr;
+    bool stopping = false;
+    // The caller meets the workers at both ends of a step, the workers meet between its phases
+    Barrier edge, phase;
+    std::vector<std::thread> workers;
+};
+
+/**
+    Channel
+    A bounded queue of tensors between two threads. Pushing to a full
+    channel or popping from an empty one blocks, and both throw once the
+    channel is closed.
+*/
+class Channel {
+public:
+    explicit Channel(size_t);
+    void push(Tensor&&);
+    Tensor pop();
+    void close();
+    // Empties the channel and opens it again
+    void reset();
+private:
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<Tensor> items;
+    size_t capacity;
+    bool closed = false;
+};
+
+/**
+    Pipeline
+    Splits a model into a sequence of stages, each a net built and run on a
+    thread of its own and optionally pinned to a group of cores. A step
+    streams micro-batches through the stages on a one forward, one backward
+    schedule: stage s runs stages - s - 1 forward passes ahead, then
+    alternates a forward and a backward pass, so each stage holds at most
+    that many micro-batches in flight. A micro-batch's saved activations
+    and gradients are freed as soon as its backward pass is done, only its
+    empty nodes stay on the tape until the step ends. Activations flow down bounded
+    channels and their gradients flow back up. Each stage accumulates the
+    gradients of every micro-batch and steps its own optimiser at the end.
+*/
+class Pipeline {
+public:
+    /**
+        Stage
+        Builds the net of a stage and runs its forward pass on an input
+        for a numbered micro-batch. The first stage gets the micro-batch
+        itself, the last returns its loss.
+    */
+    struct Stage {
+        std::function<std::unique_ptr<Net>()> build;
+        std::function<Var(Net&, const Var&, size_t)> forward;
+        // Cores the stage's thread is pinned to, empty to leave it unpinned
+        std::vector<int> cores;
+    };
+
+    /**
+        Timing
+        Seconds each stage spent computing and waiting on its channels in
+        the last step, and the length of the step
+    */
+    struct Timing {
+        std::vector<double> busy, waiting;
+        double elapsed = 0;
+        // Fraction of the stages' time spent idle, whether from the pipeline
+        // filling and draining or from stages of uneven cost
+        double bubble() const;
+    };
+
+    typedef std::function<std::unique_ptr<opt::Opt>(Net&)> Optimiser;
+
+    // Channels hold up to capacity tensors, as many as there are stages when 0
+    Pipeline(const std::vector<Stage>&, const Optimiser&, size_t capacity = 0);
+    ~Pipeline();
+    Pipeline(const Pipeline&) = delete;
+    Pipeline& operator=(const Pipeline&) = delete;
+
+    // One step over the micro-batches, returns their mean loss
+    // Rethrows the first exception a stage threw, the step is then skipped
+    double step(const std::vector<Tensor>&);
+
+    // Net of a stage. Other threads may only run it under a NoGradGuard, between steps.
+    Net& stage(size_t s) { return *nets[s]; }
+    size_t size() const { return nets.size(); }
+    const Timing& timing() const { return timings; }
+
+private:
+    void work(size_t, const Optimiser&);
+    void run(size_t);
+    void fail(std::exception_ptr);
+    bool failed();
+
+    std::vector<Stage> stages;
+    std::vector<std::unique_ptr<Net>> nets;
+    std::vector<std::unique_ptr<opt::Opt>> optimisers;
+    // forward[s] carries activations into stage s + 1, backward[s] their gradients back
+    std::vector<std::unique_ptr<Channel>> forward, backward;
+    std::vector<double> losses;
+    Timing timings;
+    const std::vector<Tensor>* batches = nullptr;
+    std::mutex lock;
+    std::exception_ptr error;
+    bool stopping = false;
+    Barrier edge, phase;
+    std::vector<std::thread> workers;
+};
+
+} // namespace nn
+#endif // PARALLEL_H
@@ -0,0 +1,74 @@
+#include "pool.hpp"
+
+namespace autodiff {
+
+WorkerPool::WorkerPool(size_t n) {
+    for(size_t i=0; i<n; ++i) {
+        threads.emplace_back([this]{ work(); });
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    queued.notify_all();
+    for(auto &thread : threads) {
+        thread.join();
+    }
+}
+
+void WorkerPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        tasks.push_back(std::move(task));
+    }
+    queued.notify_one();
+    // The thread in wait() sleeps on idle, and takes tasks like any worker
+    idle.notify_one();
+}
+
+bool WorkerPool::run_one(std::unique_lock<std::mutex>& held) {
+    if(tasks.empty()) return false;
+    auto task = std::move(tasks.front());
+    tasks.pop_front();
+    ++running;
+    held.unlock();
+    try {
+        task();
+    }
+    catch(...) {
+        held.lock();
+        if(!error) error = std::current_exception();
+        held.unlock();
+    }
+    held.lock();
+    if(--running == 0 && tasks.empty()) idle.notify_all();
+    return true;
+}
+
+void WorkerPool::work() {
+    std::unique_lock<std::mutex> held(lock);
+    while(true) {
+        queued.wait(held, [this]{ return stopping || !tasks.empty(); });
+        if(stopping) return;
+        run_one(held);
+    }
+}
+
+void WorkerPool::wait() {
+    std::unique_lock<std::mutex> held(lock);
+    while(true) {
+        if(run_one(held)) continue;
+        if(running == 0) break;
+        // Woken either by new tasks to help with or by the queue draining
+        idle.wait(held, [this]{ return !tasks.empty() || running == 0; });
+    }
+    auto thrown = error;
+    error = nullptr;
+    held.unlock();
+    if(thrown) std::rethrow_exception(thrown);
+}
+
+} // namespace autodiff
@@ -0,0 +1,57 @@
+/**
+    Pool
+    A small worker pool used to run independent parts of the backward pass
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace autodiff {
+
+/**
+    WorkerPool
+    A fixed set of threads draining a shared queue of tasks. The thread
+    waiting on the pool works through the queue as well, so a pool of
+    n threads runs up to n + 1 tasks at once.
+*/
+class WorkerPool {
+public:
+    explicit WorkerPool(size_t);
+    ~WorkerPool();
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    // Queues a task, tasks may submit further tasks while running
+    void submit(std::function<void()>);
+
+    // Runs tasks until the queue is empty and none are running
+    // Rethrows the first exception a task threw
+    void wait();
+
+    size_t size() const { return threads.size(); }
+
+private:
+    void work();
+    // Runs the front task with the lock released, returns false if there was none
+    bool run_one(std::unique_lock<std::mutex>&);
+
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> tasks;
+    std::mutex lock;
+    std::condition_variable queued;
+    std::condition_variable idle;
+    std::exception_ptr error;
+    size_t running = 0;
+    bool stopping = false;
+};
+
+} // namespace autodiff
+#endif // POOL_H
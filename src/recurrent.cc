@@ -0,0 +1,192 @@
+/**
+    Recurrent
+    Fused kernels for LSTM and GRU sequences. The projection of the inputs
+    holds one column per sample and timestep, timestep t of sample b in
+    column t * batch + b, and the gate pre-activations stacked by row.
+ */
+#include "tape.hpp"
+
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+#ifdef __APPLE__
+#include <Accelerate/Accelerate.h>
+#else
+#include <cblas.h>
+#include <atlas.h>
+#endif // __APPLE__
+
+using std::vector;
+
+static const std::string shape_err = "Recurrent projections must hold every gate for each timestep of the batch";
+
+static double sigmoid(double x) { return 1 / (1 + std::exp(-x)); }
+
+// c = op(a) * op(b) + beta * c on row-major tensors, with the transposes
+// taken in place by the BLAS rather than formed
+static void gemm(bool trans_a, const Tensor& a, bool trans_b, const Tensor& b, double beta, Tensor& c) {
+    auto m = static_cast<int>(c.shape[1]);
+    auto n = static_cast<int>(c.shape[0]);
+    auto k = static_cast<int>(trans_a ? a.shape[1] : a.shape[0]);
+    cblas_dgemm(CblasRowMajor, trans_a ? CblasTrans : CblasNoTrans, trans_b ? CblasTrans : CblasNoTrans,
+                m, n, k, 1, a.ptr(), static_cast<int>(a.shape[0]), b.ptr(), static_cast<int>(b.shape[0]),
+                beta, c.ptr(), n);
+}
+
+/**
+    Sequence
+    Sizes of a recurrence, an LSTM stacks the input, forget, cell and output
+    gates and a GRU the reset, update and new gates. A GRU weight has an
+    extra input column holding the recurrent bias, which the reset gate
+    scales along with the rest of the new gate's recurrent term.
+*/
+struct Sequence {
+    size_t batch, steps, hidden, gates, width;
+
+    Sequence(OpType type, double scalar, const Tensor& proj, const Tensor& weight)
+    : batch(static_cast<size_t>(scalar)) {
+        auto lstm = type == OpType::lstm_seq;
+        gates = lstm ? 4 : 3;
+        width = weight.shape[0];
+        hidden = lstm ? width : width - 1;
+        if(batch == 0 || proj.shape[0] % batch || hidden == 0) throw std::invalid_argument(shape_err);
+        steps = proj.shape[0] / batch;
+        auto rows = gates * hidden;
+        if(weight.size / width != rows || proj.size / proj.shape[0] != rows) throw std::invalid_argument(shape_err);
+    }
+
+    // Offset of gate k of unit r for sample b at step t in the projection
+    size_t at(size_t k, size_t r, size_t t, size_t b) const {
+        return (k * hidden + r) * steps * batch + t * batch + b;
+    }
+};
+
+// Runs the recurrence from a zero state, writing every hidden state to out.
+// When traced it also keeps the state entering each step, the gate
+// activations and the cell entering each step of an LSTM, or the recurrent
+// term of the new gate of a GRU, as read by the backward pass.
+static void run(OpType type, const Sequence& seq, const Tensor& proj, const Tensor& weight, Tensor& out,
+                vector<Tensor>* states, vector<Tensor>* cells, vector<Tensor>* acts) {
+    auto H = seq.hidden, B = seq.batch;
+    auto lstm = type == OpType::lstm_seq;
+    // The GRU state carries a row of ones that picks up the recurrent bias
+    Tensor h({{B, seq.width, 1, 1}}, 1), c({{B, H, 1, 1}}, 0);
+    for(size_t i=0; i<H*B; ++i) h.ptr()[i] = 0;
+    Tensor pre(B, seq.gates * H), act(pre.shape);
+    auto p = proj.ptr();
+    for(size_t t=0; t<seq.steps; ++t) {
+        if(states) store((*states)[t], h);
+        if(cells && lstm) store((*cells)[t], c);
+        // One GEMM for every gate of the step
+        nn::matmul(weight, h, pre);
+        auto pre_ptr = pre.ptr();
+        auto a = act.ptr();
+        auto h_ptr = h.ptr();
+        auto c_ptr = c.ptr();
+        for(size_t r=0; r<H; ++r) {
+            for(size_t b=0; b<B; ++b) {
+                auto j = r * B + b;
+                auto gate = [&](size_t k) { return pre_ptr[k * H * B + j] + p[seq.at(k, r, t, b)]; };
+                if(lstm) {
+                    auto i = sigmoid(gate(0)), f = sigmoid(gate(1)), g = std::tanh(gate(2)), o = sigmoid(gate(3));
+                    c_ptr[j] = f * c_ptr[j] + i * g;
+                    h_ptr[j] = o * std::tanh(c_ptr[j]);
+                    a[j] = i; a[H * B + j] = f; a[2 * H * B + j] = g; a[3 * H * B + j] = o;
+                }
+                else {
+                    // The recurrent term of the new gate is kept for its gradient
+                    auto hn = pre_ptr[2 * H * B + j];
+                    auto reset = sigmoid(gate(0)), update = sigmoid(gate(1));
+                    auto n = std::tanh(p[seq.at(2, r, t, b)] + reset * hn);
+                    h_ptr[j] = (1 - update) * n + update * h_ptr[j];
+                    a[j] = reset; a[H * B + j] = update; a[2 * H * B + j] = n; c_ptr[j] = hn;
+                }
+                out.ptr()[r * seq.steps * B + t * B + b] = h_ptr[j];
+            }
+        }
+        if(acts) store((*acts)[t], act);
+        if(cells && !lstm) store((*cells)[t], c);
+    }
+}
+
+void recurrent(OpType type, double scalar, const Tensor& proj, const Tensor& weight, Tensor& out) {
+    Sequence seq(type, scalar, proj, weight);
+    if(out.shape[0] != seq.steps * seq.batch || out.size != seq.steps * seq.batch * seq.hidden) {
+        throw std::invalid_argument(shape_err);
+    }
+    run(type, seq, proj, weight, out, nullptr, nullptr, nullptr);
+}
+
+Tensor recurrent(OpType type, double scalar, const Tensor& proj, const Tensor& weight) {
+    Sequence seq(type, scalar, proj, weight);
+    Tensor out(seq.steps * seq.batch, seq.hidden);
+    run(type, seq, proj, weight, out, nullptr, nullptr, nullptr);
+    return out;
+}
+
+// Backpropagation through time, the forward recurrence is run again to
+// recover the gates rather than keeping them on the tape. Walking back
+// from the last step, each step forms the gradient of its pre-activations
+// in one fused pass and then takes two GEMMs, one accumulating the weight
+// gradient and one carrying the state gradient to the previous step.
+void recurrent_vjp(OpType type, double scalar, const Tensor& g, const Tensor& proj, const Tensor& weight,
+                   Tensor* g_proj, Tensor* g_weight) {
+    Sequence seq(type, scalar, proj, weight);
+    auto H = seq.hidden, B = seq.batch, T = seq.steps;
+    auto lstm = type == OpType::lstm_seq;
+    vector<Tensor> states(T), cells(T), acts(T);
+    Tensor out(g.shape);
+    run(type, seq, proj, weight, out, &states, &cells, &acts);
+
+    Tensor dh({{B, seq.width, 1, 1}}, 0), dc({{B, H, 1, 1}}, 0), d_pre(B, seq.gates * H);
+    auto g_ptr = g.ptr();
+    for(size_t t=T; t-- >0;) {
+        auto a = acts[t].ptr();
+        auto h_prev = states[t].ptr();
+        auto dh_ptr = dh.ptr();
+        auto dc_ptr = dc.ptr();
+        auto d = d_pre.ptr();
+        for(size_t r=0; r<H; ++r) {
+            for(size_t b=0; b<B; ++b) {
+                auto j = r * B + b;
+                auto dh_j = dh_ptr[j] + g_ptr[r * T * B + t * B + b];
+                if(lstm) {
+                    auto i = a[j], f = a[H * B + j], c_g = a[2 * H * B + j], o = a[3 * H * B + j];
+                    // Only the cell entering the step is kept, its output is recomputed
+                    auto c = f * cells[t].ptr()[j] + i * c_g;
+                    auto tanh_c = std::tanh(c);
+                    auto dc_j = dc_ptr[j] + dh_j * o * (1 - tanh_c * tanh_c);
+                    d[j] = dc_j * c_g * i * (1 - i);
+                    d[H * B + j] = dc_j * cells[t].ptr()[j] * f * (1 - f);
+                    d[2 * H * B + j] = dc_j * i * (1 - c_g * c_g);
+                    d[3 * H * B + j] = dh_j * tanh_c * o * (1 - o);
+                    dc_ptr[j] = dc_j * f;
+                }
+                else {
+                    auto reset = a[j], update = a[H * B + j], n = a[2 * H * B + j];
+                    auto hn = cells[t].ptr()[j];
+                    auto dn = dh_j * (1 - update) * (1 - n * n);
+                    d[j] = dn * hn * reset * (1 - reset);
+                    d[H * B + j] = dh_j * (h_prev[j] - n) * update * (1 - update);
+                    // The input projection of the new gate sees dn directly
+                    if(g_proj) g_proj->ptr()[seq.at(2, r, t, b)] += dn;
+                    d[2 * H * B + j] = dn * reset;
+                    dh_ptr[j] = dh_j * update;
+                }
+            }
+        }
+        if(g_proj) {
+            auto gp = g_proj->ptr();
+            auto input_gates = lstm ? seq.gates : 2;
+            for(size_t k=0; k<input_gates; ++k) {
+                for(size_t r=0; r<H; ++r) {
+                    for(size_t b=0; b<B; ++b) gp[seq.at(k, r, t, b)] += d[(k * H + r) * B + b];
+                }
+            }
+        }
+        if(g_weight) gemm(false, d_pre, true, states[t], 1, *g_weight);
+        // The GRU keeps its direct term in dh, the bias row is dropped below
+        gemm(true, weight, false, d_pre, lstm ? 0 : 1, dh);
+    }
+}
@@ -0,0 +1,66 @@
+/**
+    Sparse
+    Sparse matrices and their products with dense tensors
+ */
+
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include "tensor.hpp"
+
+#include <vector>
+
+namespace nn {
+
+/**
+    SparseTensor
+    A matrix holding only its nonzero entries in compressed sparse row
+    form, the entries of row r run from row_starts()[r] to
+    row_starts()[r + 1] in order of column. As with Tensor, shape[0] is the
+    number of columns and shape[1] the number of rows, so a batch of sparse
+    inputs has a column per sample.
+*/
+class SparseTensor {
+public:
+    // An empty matrix
+    explicit SparseTensor(const Shape&);
+    // From coordinate form, the row, column and value of each entry in any
+    // order. Repeated coordinates are summed.
+    SparseTensor(const Shape&, const std::vector<size_t>&, const std::vector<size_t>&, const std::vector<double>&);
+    // The nonzero entries of a dense matrix
+    explicit SparseTensor(const Tensor&);
+
+    Shape shape;
+
+    size_t nnz() const { return vals.size(); }
+    const std::vector<size_t>& row_starts() const { return starts; }
+    const std::vector<size_t>& columns() const { return cols; }
+    const std::vector<double>& values() const { return vals; }
+    // Rows holding at least one entry, in order
+    const std::vector<size_t>& occupied() const { return rows; }
+
+    // Row of each entry, which along with columns() and values() gives the coordinate form
+    std::vector<size_t> coo_rows() const;
+    Tensor dense() const;
+
+private:
+    std::vector<size_t> starts, cols, rows;
+    std::vector<double> vals;
+};
+
+// out = a * b, a sparse product with each row of a scaling rows of b
+void matmul(const SparseTensor&, const Tensor&, Tensor&);
+// out = a * b, visiting only the rows of b with entries
+void matmul(const Tensor&, const SparseTensor&, Tensor&);
+// out += a * b^T, only the columns of out matching the occupied rows of b change
+void matmul_add_t(const Tensor&, const SparseTensor&, Tensor&);
+Tensor operator*(const SparseTensor&, const Tensor&);
+Tensor operator*(const Tensor&, const SparseTensor&);
+
+// Number of threads the sparse products of the calling thread run on, each
+// taking a block of rows of the result
+void set_sparse_threads(size_t);
+size_t sparse_threads();
+
+} // namespace nn
+#endif // SPARSE_H
@@ -0,0 +1,395 @@
+/**
+    Tape
+    Internals of the autodiff module shared between the tape and the code
+    that plans over recorded graphs. Not part of the public interface.
+ */
+
+#ifndef TAPE_H
+#define TAPE_H
+
+#include "autodiff.hpp"
+
+#include <algorithm>
+#include <array>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <stdexcept>
+
+namespace autodiff {
+/**
+    OpType
+    The operation a tape node was recorded from, selects the vector-Jacobian
+    product used when backpropagating through it
+*/
+enum class OpType{leaf, add, sub, mul, div, matmul, scale, pow_const, pow, log,
+                  sin, cos, tan, asin, acos, atan, sum, abs_sum, conv_1d, checkpoint,
+                  exp, tanh, sigmoid, relu, gelu, softmax, batch_norm, layer_norm,
+                  // Fused operations, emitted directly or by the Graph fusion pass
+                  linear, sq_err_sum, abs_err_sum, softmax_ce, lstm_seq, gru_seq,
+                  attention, causal_attention, embedding, sparse_linear, scale_shift,
+                  // Linear followed by the activation whose OpType is the scalar, Graph only
+                  linear_act};
+}
+
+using autodiff::OpType;
+using nn::Tensor;
+
+// Operands an OpType keeps on the tape for its vector-Jacobian product
+enum Saves{save_none = 0, save_x = 1, save_y = 2, save_out = 4};
+
+inline int saves(OpType type) {
+    switch(type) {
+        case OpType::mul:
+        case OpType::div:
+        case OpType::matmul:
+        case OpType::pow:
+        case OpType::conv_1d:
+        case OpType::linear:
+        case OpType::sq_err_sum:
+        case OpType::abs_err_sum:
+        case OpType::softmax_ce:
+        case OpType::batch_norm:
+        case OpType::layer_norm:
+        case OpType::lstm_seq:
+        case OpType::gru_seq:
+        case OpType::scale_shift:
+            return save_x | save_y;
+        case OpType::linear_act:
+            return save_x | save_y | save_out;
+        case OpType::embedding:
+            return save_y;
+        case OpType::pow_const:
+        case OpType::log:
+        case OpType::sin:
+        case OpType::cos:
+        case OpType::tan:
+        case OpType::asin:
+        case OpType::acos:
+        case OpType::atan:
+        case OpType::abs_sum:
+        case OpType::checkpoint:
+        case OpType::gelu:
+        case OpType::attention:
+        case OpType::causal_attention:
+            return save_x;
+        // Derivatives written in terms of the output
+        case OpType::exp:
+        case OpType::tanh:
+        case OpType::sigmoid:
+        case OpType::relu:
+        case OpType::softmax:
+            return save_out;
+        default:
+            return save_none;
+    }
+}
+
+// Whether the gradient of x can be formed by overwriting the output gradient
+inline bool in_place(OpType type) {
+    switch(type) {
+        case OpType::add:
+        case OpType::sub:
+        case OpType::scale:
+        case OpType::pow_const:
+        case OpType::log:
+        case OpType::sin:
+        case OpType::cos:
+        case OpType::exp:
+        case OpType::tanh:
+        case OpType::sigmoid:
+        case OpType::relu:
+        case OpType::gelu:
+        case OpType::softmax:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Tape index of a Var computed while recording was disabled
+static const size_t untracked = static_cast<size_t>(-1);
+
+/**
+    WegnerntNode
+    A node holding the operation applied to up to three parents x, y and z.
+    Only the operands its vector-Jacobian product reads are kept, x in
+    saved[0] and y or the output in saved[1]. Nodes that don't lead to a
+    leaf requiring gradients keep nothing. Checkpoint nodes also hold the
+    segment to recompute. Nodes recorded in forward mode keep the tangents
+    of their saved operands alongside them. Products with a sparse input
+    share it through operand rather than copying it into a dense slot.
+*/
+struct WegnerntNode{
+    std::array<size_t, 3> parents;
+    std::array<Tensor, 2> saved;
+    std::array<Tensor, 2> tangents;
+    std::function<void(size_t)> recompute;
+    std::shared_ptr<const nn::SparseTensor> operand;
+    nn::Shape shape;
+    double scalar;
+    OpType type;
+    bool requires_grad;
+    // Whether the gradient slot has been allocated and zeroed for this node
+    bool has_grad;
+    bool has_tangents;
+    // Leaves with a row-sparse gradient keep it in rows instead of the gradient slot
+    bool sparse;
+    autodiff::RowGrad rows;
+    // Called on leaves once a backward pass has completed their gradient
+    std::function<void()> hook;
+    
+    // Zero parent variable intialiser
+    WegnerntNode()
+    : parents{{untracked, untracked, untracked}}, shape{{0,0,0,0}}, scalar(0), type(OpType::leaf),
+      requires_grad(false), has_grad(false), has_tangents(false), sparse(false){}
+};
+
+// Copies a value into a recycled tensor slot, only reallocating on a size change
+inline void store(Tensor& slot, const Tensor& value) {
+    slot.resize(value.shape);
+    slot = value;
+}
+
+/**
+    Operands
+    The values a vector-Jacobian product is evaluated at
+*/
+struct Operands{
+    const Tensor* x;
+    const Tensor* y;
+    const Tensor* out;
+};
+
+/**
+    WengerntList
+    A ticker tape which holds the nodes for each operation on a Variable
+    Entries past length are left over from a reset and are recycled by
+    later pushes, so a steady training loop reuses the same buffers
+*/
+struct WengerntList{
+    std::vector<WegnerntNode> nodes;
+    std::vector<Tensor> grads;
+    // Scratch marks for each nested backward pass, kept to avoid reallocating
+    std::vector<std::vector<char>> marks;
+    // Output value of every node, only kept while a Graph is capturing
+    std::vector<Tensor> values;
+    // Operands recorded without a node, keyed by 3 * node + operand, also only while capturing
+    std::unordered_map<size_t, Tensor> constants;
+    bool capturing = false;
+    // Whether any leaf has been given a hook, otherwise passes skip looking for them
+    bool hooked = false;
+    size_t depth = 0;
+    size_t length = 0;
+    // Nodes below this survive a reset, such as the parameters of every net on the thread
+    size_t persistent = 0;
+    // Kept nodes given back by their owner, persistent drops below them once they are on top
+    std::set<size_t> abandoned;
+
+    // Claims the next node for a value of the given shape, its
+    // gradient is only allocated once a backward pass reaches it
+    size_t claim(const nn::Shape& shape){
+        if(length == nodes.size()) {
+            nodes.emplace_back();
+            grads.emplace_back(nodes.back().shape);
+        }
+        auto &node = nodes[length];
+        node.shape = shape;
+        node.has_grad = false;
+        // A recycled leaf may have had its gradient bound to outside memory
+        if(grads[length].is_view()) grads[length].bind(nullptr, nn::Shape{});
+        return length++;
+    }
+
+    // Keeps the value of a node while capturing
+    void keep(size_t index, const Tensor& value) {
+        if(!capturing) return;
+        if(values.size() <= index) values.resize(index + 1);
+        store(values[index], value);
+    }
+
+    // Keeps operand k of a node while capturing when it isn't on the tape
+    void keep_constant(size_t index, size_t k, const Tensor& value) {
+        if(capturing) store(constants[3 * index + k], value);
+    }
+
+    // Appends a zero parent variable to the tape
+    size_t push_0(const Tensor& data){
+        auto index = claim(data.shape);
+        keep(index, data);
+        auto &node = nodes[index];
+        node.parents = {{untracked, untracked, untracked}};
+        node.scalar = 0;
+        node.type = OpType::leaf;
+        node.requires_grad = false;
+        node.has_tangents = false;
+        node.sparse = false;
+        node.rows.clear();
+        node.recompute = nullptr;
+        node.operand = nullptr;
+        node.hook = nullptr;
+        return index;
+    }
+
+    // Appends an operation on up to three parents, unused parents are untracked
+    size_t push(OpType type, const std::array<size_t, 3>& parents, double scalar,
+                const Tensor& x, const Tensor& y, const Tensor& out){
+        auto index = claim(out.shape);
+        keep(index, out);
+        auto &node = nodes[index];
+        node.parents = parents;
+        node.scalar = scalar;
+        node.type = type;
+        node.recompute = nullptr;
+        node.operand = nullptr;
+        node.has_tangents = false;
+        // A recycled node may have been a sparse or hooked leaf
+        node.sparse = false;
+        node.hook = nullptr;
+        // Checkpointed segments may close over parameters so always need gradients
+        node.requires_grad = type == OpType::checkpoint || requires_grad(parents[0])
+            || requires_grad(parents[1]) || requires_grad(parents[2]);
+        if(!node.requires_grad) return index;
+        auto kept = saves(type);
+        if(kept & save_x) store(node.saved[0], x);
+        if(kept & save_y) store(node.saved[1], y);
+        else if(kept & save_out) store(node.saved[1], out);
+        return index;
+    }
+
+    bool requires_grad(size_t index) const {
+        return index != untracked && nodes[index].requires_grad;
+    }
+
+    // Gradient of a node, allocated and zeroed on first use
+    Tensor& grad(size_t index) {
+        auto &node = nodes[index];
+        if(node.sparse) throw std::logic_error("Sparse gradients can only be taken through embedding lookups");
+        if(!node.has_grad) {
+            grads[index].resize(node.shape);
+            grads[index].zeros();
+            node.has_grad = true;
+        }
+        return grads[index];
+    }
+
+    // Row gradient of a sparse leaf, null otherwise
+    autodiff::RowGrad* rows(size_t index) {
+        return index != untracked && nodes[index].sparse ? &nodes[index].rows : nullptr;
+    }
+
+    // Operands of a node as kept on the tape
+    Operands operands(const WegnerntNode& node) const {
+        auto kept = saves(node.type);
+        const Tensor* out = (kept & save_out) ? &node.saved[1] : nullptr;
+        return {&node.saved[0], &node.saved[1], out};
+    }
+
+    // Tangents of the kept operands of a node
+    Operands tangents(const WegnerntNode& node) const {
+        return {&node.tangents[0], &node.tangents[1], nullptr};
+    }
+
+    // Marks the nodes reachable from index that lead to a leaf requiring
+    // gradients, zeroing their non-leaf gradients. Nodes below floor are
+    // treated as leaves. Returns the lowest mark.
+    size_t mark(size_t index, size_t floor, std::vector<char>& reached) {
+        reached.assign(index + 1, 0);
+        reached[index] = 1;
+        auto lowest = index;
+        for(size_t i=index+1; i-- >floor;) {
+            if(!reached[i]) continue;
+            lowest = i;
+            auto &node = nodes[i];
+            if(node.type == OpType::leaf) continue;
+            grad(i).zeros();
+            for(auto parent : node.parents) {
+                if(requires_grad(parent)) reached[parent] = 1;
+            }
+        }
+        return lowest;
+    }
+
+    // Drops every node past n, the dropped buffers stay allocated for reuse
+    void drop(size_t n) {
+        if(n > length) throw std::invalid_argument("Cannot reset the tape past its end");
+        length = n;
+        persistent = std::min(persistent, n);
+        abandoned.erase(abandoned.lower_bound(n), abandoned.end());
+    }
+
+    // Gives back a kept node, lowering persistent past every given back node
+    // on top. With nothing recorded above them they leave the tape as well.
+    void abandon(size_t index) {
+        auto top = length == persistent;
+        abandoned.insert(index);
+        while(!abandoned.empty() && *abandoned.rbegin() + 1 == persistent) {
+            abandoned.erase(--abandoned.end());
+            --persistent;
+        }
+        if(top) length = persistent;
+    }
+
+    // Frees the buffers of nodes first to last, which no later pass may
+    // reach. They stop requiring gradients and stay on the tape, holding
+    // nothing, until it is reset past them.
+    void release(size_t first, size_t last) {
+        for(auto i=first; i<=last; ++i) {
+            auto &node = nodes[i];
+            for(auto slot : {&node.saved[0], &node.saved[1], &node.tangents[0], &node.tangents[1]}) {
+                slot->bind(nullptr, nn::Shape{});
+            }
+            // Gradients bound to memory owned elsewhere are left to their owner
+            if(!grads[i].is_view()) grads[i].bind(nullptr, nn::Shape{});
+            node.operand = nullptr;
+            node.recompute = nullptr;
+            node.has_grad = false;
+            node.has_tangents = false;
+            node.requires_grad = false;
+        }
+    }
+
+    // Drops every node past n and zeroes the gradients of the rest
+    void truncate(size_t n) {
+        drop(n);
+        for(size_t i=0; i<length; ++i) {
+            if(nodes[i].has_grad) grads[i].zeros();
+            if(nodes[i].sparse) nodes[i].rows.clear();
+        }
+    }
+
+    size_t size() { return length; }
+
+    auto begin() { return nodes.begin(); }
+    auto end(){ return nodes.begin() + length; }
+};
+
+extern thread_local WengerntList tape;
+
+// Evaluates an operation on the values of its parents x, y and z
+Tensor apply(OpType, double, const Tensor&, const Tensor&, const Tensor&);
+
+// Evaluates an operation into a preallocated result of the right shape
+void apply(OpType, double, const Tensor&, const Tensor&, const Tensor&, Tensor&);
+
+// Accumulates the vector-Jacobian product of the gradient g through an
+// operation into the parent gradients gx, gy and gz, any of which may be null
+void vjp(OpType, double, const Tensor&, const Operands&, Tensor*, Tensor*, Tensor*);
+
+// Turns the output gradient g of an in_place operation into the gradient of x
+void vjp_in_place(OpType, double, Tensor&, const Operands&);
+
+// Runs an lstm_seq or gru_seq over the projected inputs with the recurrent
+// weight, the scalar is the batch size. Defined in recurrent.cc.
+Tensor recurrent(OpType, double, const Tensor&, const Tensor&);
+void recurrent(OpType, double, const Tensor&, const Tensor&, Tensor&);
+
+// Accumulates the gradients of the projection and weight of a recurrence
+void recurrent_vjp(OpType, double, const Tensor&, const Tensor&, const Tensor&, Tensor*, Tensor*);
+
+// Accumulates the gradient g of an embedding lookup of ids into the rows of a sparse table
+void embedding_vjp(const Tensor&, const Tensor&, autodiff::RowGrad&);
+
+#endif // TAPE_H
@@ -7,6 +7,7 @@
 
 #include <memory>
 #include <array>
+#include <cstdint>
 
 namespace nn {
 
@@ -27,7 +28,59 @@ Tensor conv_1d(const Tensor&, const Tensor&);
 Tensor conv2d(const Tensor&, const Tensor&);
 double dot(const Tensor& lhs, const Tensor& rhs);
 
+// Activations, the two argument forms write into a result of the same shape
+// softmax normalises each column
+Tensor exp(const Tensor&);
+Tensor tanh(const Tensor&);
+Tensor sigmoid(const Tensor&);
+Tensor relu(const Tensor&);
+Tensor gelu(const Tensor&);
+Tensor softmax(const Tensor&);
+void exp(const Tensor&, Tensor&);
+void tanh(const Tensor&, Tensor&);
+void sigmoid(const Tensor&, Tensor&);
+void relu(const Tensor&, Tensor&);
+void gelu(const Tensor&, Tensor&);
+void softmax(const Tensor&, Tensor&);
+void matmul(const Tensor&, const Tensor&, Tensor&);
+// Mean and biased variance of each row, or of each column when per_row is false
+void moments(const Tensor&, Tensor&, Tensor&, bool);
+
+// Multi-head attention of the query columns against the first n key and
+// value columns, the heads split the rows evenly. Query i sits at position
+// offset + i and under a causal mask only sees keys up to that position.
+// Runs in tiles with an online softmax so the score matrix is never formed,
+// lse receives the log-sum-exp of the scores of each query and head.
+void attention(const Tensor&, const Tensor&, const Tensor&, size_t, size_t, size_t, bool, Tensor&, Tensor* =nullptr);
+// Accumulates the query, key and value gradients of a self-attention over
+// every key from its output, log-sum-exp and output gradient
+void attention_grad(const Tensor&, const Tensor&, const Tensor&, const Tensor&, const Tensor&, const Tensor&,
+                    size_t, bool, Tensor&, Tensor&, Tensor&);
+
+// Values the rows of qgemm operands are padded to a multiple of, one 512
+// bit register of bytes
+const size_t quant_block = 64;
+
+// Int8 products for quantized inference, acc[o * batch + b] is the dot
+// product of row o of an out x in weight with row b of batch x in inputs,
+// which hold each value offset by 128 as an unsigned byte. Rows are padded
+// with zeros to a multiple of quant_block values. Runs on AVX-512 VNNI when
+// built for it, the sums must fit in 32 bits.
+void qgemm(const std::int8_t*, const std::uint8_t*, size_t, size_t, size_t, std::int32_t*);
+
 typedef std::array<size_t, 4> Shape;
+
+/**
+    Buffer
+    Deleter for tensor memory, views into memory owned elsewhere are left alone
+*/
+struct Buffer {
+    bool owned = true;
+    Buffer() = default;
+    Buffer(bool owned_) : owned(owned_) {}
+    Buffer(const std::default_delete<double[]>&) {}
+    void operator()(double* memory) const { if(owned) delete[] memory; }
+};
   
 /**
     Tensor
@@ -35,14 +88,17 @@ typedef std::array<size_t, 4> Shape;
 */
 class Tensor {
     private:
-        std::unique_ptr<double[]> data;
+        std::unique_ptr<double[], Buffer> data;
     public:
         // Can be initialised using a size, an array of sizes with a constant or another tensor
         Tensor(size_t, size_t=1, size_t=1, size_t=1);
         Tensor(const Shape&);
         Tensor(const Shape&, double);
         Tensor(const Tensor&);
+        Tensor(Tensor&&) noexcept;
         Tensor();
+        // Non-owning view over existing memory, which must outlive the tensor
+        Tensor(double*, const Shape&);
         
         size_t size;
         Shape shape;
@@ -62,6 +118,11 @@ class Tensor {
         
         Iterator begin() const { return Iterator(data.get()); }
         Iterator end() const { return Iterator(data.get()+size); }
+
+        // Raw pointer to the underlying row-major buffer
+        double* ptr() const { return data.get(); }
+        // Whether the tensor views memory it doesn't own
+        bool is_view() const { return !data.get_deleter().owned; }
         
         // Formatted ostream
         friend std::ostream& operator<<(std::ostream&, const Tensor&);
@@ -71,6 +132,13 @@ class Tensor {
         double &operator()(size_t x, size_t y=0, size_t z=0, size_t t=0);
         double operator()(size_t x, size_t y=0, size_t z=0, size_t t=0) const;
         
+        // Reshapes in place, reallocating only if the number of elements changes
+        // A view that is reallocated owns its new buffer
+        void resize(const Shape&);
+        // Turns the tensor into a view of memory owned elsewhere, releasing
+        // any buffer it owned. The memory must outlive the tensor.
+        void bind(double*, const Shape&);
+
         // Sub matrix access
         Tensor row(size_t);
         Tensor col(size_t);
@@ -86,6 +154,7 @@ class Tensor {
         void set_sub_mat(size_t, size_t, size_t, const Tensor&);
         
         void operator=(const Tensor&);
+        void operator=(Tensor&&);                   // Takes the buffer and shape of a tensor, views copy instead
         Tensor operator+(const Tensor&) const;      // Pointwise addition
         Tensor operator-(const Tensor&) const;      // Pointwise subtraction
         Tensor operator*(const Tensor&) const;      // Matrix multiplication
@@ -107,6 +176,8 @@ class Tensor {
         Tensor t()const;
         // Dot product
         friend double nn::dot(const Tensor& lhs, const Tensor& rhs);
+        // Matrix multiplication into an existing result
+        friend void nn::matmul(const Tensor&, const Tensor&, Tensor&);
         
         // Constant arithmatic
         friend Tensor operator+(double, const Tensor&);
@@ -124,8 +195,8 @@ class Tensor {
         void constant(double);
 
         // Reductions
-        double abs_sum();
-        double sum();
+        double abs_sum() const;
+        double sum() const;
         
         // Trig & and arithmatic overloads
         friend Tensor sin(const Tensor& rhs);
@@ -0,0 +1,135 @@
+#include "tensor.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef __APPLE__
+#include <Accelerate/Accelerate.h>
+#endif // __APPLE__
+
+namespace nn{
+static std::string size_err {"Tensor sizes do not match"};
+
+using std::invalid_argument;
+
+static const double root_half = 0.70710678118654752440;
+
+// The kernels below are flat loops over contiguous memory with no
+// dependence between iterations so they vectorise, vForce is used instead
+// where it provides the function
+
+void exp(const Tensor& x, Tensor& result){
+    if(x.shape != result.shape) throw invalid_argument(size_err);
+    auto x_ptr = x.ptr();
+    auto r_ptr = result.ptr();
+#ifdef __APPLE__
+    auto size_ = static_cast<int>(x.size);
+    vvexp(r_ptr, x_ptr, &size_);
+#else
+    for(size_t i=0; i<x.size; ++i){
+        r_ptr[i] = std::exp(x_ptr[i]);
+    }
+#endif
+}
+
+void tanh(const Tensor& x, Tensor& result){
+    if(x.shape != result.shape) throw invalid_argument(size_err);
+    auto x_ptr = x.ptr();
+    auto r_ptr = result.ptr();
+#ifdef __APPLE__
+    auto size_ = static_cast<int>(x.size);
+    vvtanh(r_ptr, x_ptr, &size_);
+#else
+    for(size_t i=0; i<x.size; ++i){
+        r_ptr[i] = std::tanh(x_ptr[i]);
+    }
+#endif
+}
+
+void sigmoid(const Tensor& x, Tensor& result){
+    if(x.shape != result.shape) throw invalid_argument(size_err);
+    auto x_ptr = x.ptr();
+    auto r_ptr = result.ptr();
+    for(size_t i=0; i<x.size; ++i){
+        r_ptr[i] = 1 / (1 + std::exp(-x_ptr[i]));
+    }
+}
+
+void relu(const Tensor& x, Tensor& result){
+    if(x.shape != result.shape) throw invalid_argument(size_err);
+    auto x_ptr = x.ptr();
+    auto r_ptr = result.ptr();
+    for(size_t i=0; i<x.size; ++i){
+        r_ptr[i] = std::max(x_ptr[i], 0.0);
+    }
+}
+
+void gelu(const Tensor& x, Tensor& result){
+    if(x.shape != result.shape) throw invalid_argument(size_err);
+    auto x_ptr = x.ptr();
+    auto r_ptr = result.ptr();
+    for(size_t i=0; i<x.size; ++i){
+        r_ptr[i] = 0.5 * x_ptr[i] * (1 + std::erf(x_ptr[i] * root_half));
+    }
+}
+
+// Each column is one distribution, rows are walked in memory order and
+// the running maximum and sum are kept per column
+void softmax(const Tensor& x, Tensor& result){
+    if(x.shape != result.shape) throw invalid_argument(size_err);
+    auto cols = x.shape[0];
+    auto x_ptr = x.ptr();
+    auto r_ptr = result.ptr();
+    std::vector<double> peak(x_ptr, x_ptr + cols);
+    for(size_t i=cols; i<x.size; ++i){
+        peak[i % cols] = std::max(peak[i % cols], x_ptr[i]);
+    }
+    std::vector<double> total(cols, 0);
+    for(size_t i=0; i<x.size; ++i){
+        r_ptr[i] = std::exp(x_ptr[i] - peak[i % cols]);
+        total[i % cols] += r_ptr[i];
+    }
+    for(size_t i=0; i<x.size; ++i){
+        r_ptr[i] /= total[i % cols];
+    }
+}
+
+Tensor exp(const Tensor& x){
+    Tensor result(x.shape);
+    exp(x, result);
+    return result;
+}
+
+Tensor tanh(const Tensor& x){
+    Tensor result(x.shape);
+    tanh(x, result);
+    return result;
+}
+
+Tensor sigmoid(const Tensor& x){
+    Tensor result(x.shape);
+    sigmoid(x, result);
+    return result;
+}
+
+Tensor relu(const Tensor& x){
+    Tensor result(x.shape);
+    relu(x, result);
+    return result;
+}
+
+Tensor gelu(const Tensor& x){
+    Tensor result(x.shape);
+    gelu(x, result);
+    return result;
+}
+
+Tensor softmax(const Tensor& x){
+    Tensor result(x.shape);
+    softmax(x, result);
+    return result;
+}
+} // namespace nn
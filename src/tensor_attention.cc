@@ -0,0 +1,167 @@
+/**
+    Tensor attention
+    Blocked scaled dot-product attention over sequences laid out with one
+    column per token
+*/
+#include "tensor.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef __APPLE__
+#include <Accelerate/Accelerate.h>
+#else
+#include <cblas.h>
+#include <atlas.h>
+#endif // __APPLE__
+
+namespace nn{
+
+static std::string head_err {"Attention needs matching query, key and value rows split evenly between the heads"};
+
+// Queries and keys per tile, a tile of scores is the only part of the
+// score matrix ever held
+static const size_t block = 64;
+
+static const double minus_inf = -std::numeric_limits<double>::infinity();
+
+// c = alpha op(a) op(b) + beta c over row-major blocks with leading dimensions
+static void gemm(bool trans_a, bool trans_b, size_t m, size_t n, size_t k, double alpha,
+                 const double* a, size_t lda, const double* b, size_t ldb, double beta, double* c, size_t ldc) {
+    cblas_dgemm(CblasRowMajor, trans_a ? CblasTrans : CblasNoTrans, trans_b ? CblasTrans : CblasNoTrans,
+                static_cast<int>(m), static_cast<int>(n), static_cast<int>(k), alpha, a, static_cast<int>(lda),
+                b, static_cast<int>(ldb), beta, c, static_cast<int>(ldc));
+}
+
+/**
+    Tiles
+    Walks the query and key blocks of one head, with the leading dimension
+    of each tensor being its number of columns
+*/
+struct Tiles {
+    size_t rows, heads, queries, keys, offset;
+    bool causal;
+    double scale;
+
+    Tiles(const Tensor& q, const Tensor& k, const Tensor& v, size_t n, size_t heads_, size_t offset_, bool causal_)
+    : rows(q.size / q.shape[0]), heads(heads_), queries(q.shape[0]), keys(n), offset(offset_), causal(causal_) {
+        if(heads == 0 || rows % heads || k.size / k.shape[0] != rows || v.size / v.shape[0] != rows
+           || n > k.shape[0] || n > v.shape[0]) throw std::invalid_argument(head_err);
+        scale = 1 / std::sqrt(static_cast<double>(rows / heads));
+    }
+
+    size_t width() const { return rows / heads; }
+    // Keys visible to the query block starting at i0 of size bq
+    size_t limit(size_t i0, size_t bq) const { return causal ? std::min(keys, offset + i0 + bq) : keys; }
+    bool masked(size_t i, size_t j) const { return causal && j > offset + i; }
+};
+
+// Each query block keeps a running maximum m and sum l of its exponentiated
+// scores. A new tile of scores that raises the maximum rescales l and the
+// partial output by exp(m_old - m_new) before its own terms are added.
+void attention(const Tensor& q, const Tensor& k, const Tensor& v, size_t n, size_t heads, size_t offset,
+               bool causal, Tensor& out, Tensor* lse) {
+    Tiles tiles(q, k, v, n, heads, offset, causal);
+    if(out.shape != q.shape) throw std::invalid_argument(head_err);
+    auto dh = tiles.width();
+    auto ldq = q.shape[0], ldk = k.shape[0], ldv = v.shape[0], ldo = out.shape[0];
+    std::vector<double> scores(block * block), peak(block), total(block);
+    for(size_t h=0; h<heads; ++h) {
+        auto q_h = q.ptr() + h * dh * ldq;
+        auto k_h = k.ptr() + h * dh * ldk;
+        auto v_h = v.ptr() + h * dh * ldv;
+        auto o_h = out.ptr() + h * dh * ldo;
+        for(size_t i0=0; i0<tiles.queries; i0+=block) {
+            auto bq = std::min(block, tiles.queries - i0);
+            std::fill(peak.begin(), peak.end(), minus_inf);
+            std::fill(total.begin(), total.end(), 0);
+            for(size_t d=0; d<dh; ++d) std::fill(o_h + d * ldo + i0, o_h + d * ldo + i0 + bq, 0);
+            auto limit = tiles.limit(i0, bq);
+            for(size_t j0=0; j0<limit; j0+=block) {
+                auto bk = std::min(block, limit - j0);
+                auto s = scores.data();
+                gemm(true, false, bq, bk, dh, tiles.scale, q_h + i0, ldq, k_h + j0, ldk, 0, s, bk);
+                for(size_t i=0; i<bq; ++i) {
+                    auto row = s + i * bk;
+                    auto m = peak[i];
+                    for(size_t j=0; j<bk; ++j) {
+                        if(!tiles.masked(i0 + i, j0 + j)) m = std::max(m, row[j]);
+                    }
+                    if(m == minus_inf) {
+                        std::fill(row, row + bk, 0);
+                        continue;
+                    }
+                    auto alpha = std::exp(peak[i] - m);
+                    double sum = 0;
+                    for(size_t j=0; j<bk; ++j) {
+                        row[j] = tiles.masked(i0 + i, j0 + j) ? 0 : std::exp(row[j] - m);
+                        sum += row[j];
+                    }
+                    total[i] = total[i] * alpha + sum;
+                    peak[i] = m;
+                    if(alpha != 1) {
+                        for(size_t d=0; d<dh; ++d) o_h[d * ldo + i0 + i] *= alpha;
+                    }
+                }
+                gemm(false, true, dh, bq, bk, 1, v_h + j0, ldv, s, bk, 1, o_h + i0, ldo);
+            }
+            for(size_t i=0; i<bq; ++i) {
+                for(size_t d=0; d<dh; ++d) o_h[d * ldo + i0 + i] /= total[i];
+                if(lse) lse->ptr()[h * tiles.queries + i0 + i] = peak[i] + std::log(total[i]);
+            }
+        }
+    }
+}
+
+// The probabilities of each tile are rebuilt from the scores and the
+// log-sum-exp of the forward pass. With delta the dot product of each
+// output column with its gradient, the score gradient is p (dp - delta).
+void attention_grad(const Tensor& q, const Tensor& k, const Tensor& v, const Tensor& out, const Tensor& lse,
+                    const Tensor& g, size_t heads, bool causal, Tensor& dq, Tensor& dk, Tensor& dv) {
+    Tiles tiles(q, k, v, k.shape[0], heads, 0, causal);
+    auto dh = tiles.width();
+    auto ld = q.shape[0];
+    if(k.shape[0] != ld || g.shape != out.shape || dq.shape != q.shape || dk.shape != k.shape || dv.shape != v.shape) {
+        throw std::invalid_argument(head_err);
+    }
+    std::vector<double> probs(block * block), d_probs(block * block), delta(ld);
+    for(size_t h=0; h<heads; ++h) {
+        auto offset = h * dh * ld;
+        auto q_h = q.ptr() + offset, k_h = k.ptr() + offset, v_h = v.ptr() + offset;
+        auto o_h = out.ptr() + offset, g_h = g.ptr() + offset;
+        auto dq_h = dq.ptr() + offset, dk_h = dk.ptr() + offset, dv_h = dv.ptr() + offset;
+        auto lse_h = lse.ptr() + h * ld;
+        std::fill(delta.begin(), delta.end(), 0);
+        for(size_t d=0; d<dh; ++d) {
+            for(size_t i=0; i<ld; ++i) delta[i] += g_h[d * ld + i] * o_h[d * ld + i];
+        }
+        for(size_t i0=0; i0<ld; i0+=block) {
+            auto bq = std::min(block, ld - i0);
+            auto limit = tiles.limit(i0, bq);
+            for(size_t j0=0; j0<limit; j0+=block) {
+                auto bk = std::min(block, limit - j0);
+                auto p = probs.data();
+                auto dp = d_probs.data();
+                gemm(true, false, bq, bk, dh, tiles.scale, q_h + i0, ld, k_h + j0, ld, 0, p, bk);
+                for(size_t i=0; i<bq; ++i) {
+                    for(size_t j=0; j<bk; ++j) {
+                        auto &value = p[i * bk + j];
+                        value = tiles.masked(i0 + i, j0 + j) ? 0 : std::exp(value - lse_h[i0 + i]);
+                    }
+                }
+                gemm(false, false, dh, bk, bq, 1, g_h + i0, ld, p, bk, 1, dv_h + j0, ld);
+                gemm(true, false, bq, bk, dh, 1, g_h + i0, ld, v_h + j0, ld, 0, dp, bk);
+                for(size_t i=0; i<bq; ++i) {
+                    for(size_t j=0; j<bk; ++j) dp[i * bk + j] = p[i * bk + j] * (dp[i * bk + j] - delta[i0 + i]);
+                }
+                gemm(false, true, dh, bq, bk, tiles.scale, k_h + j0, ld, dp, bk, 1, dq_h + i0, ld);
+                gemm(false, false, dh, bk, bq, tiles.scale, q_h + i0, ld, dp, bk, 1, dk_h + j0, ld);
+            }
+        }
+    }
+}
+} // namespace nn
@@ -41,11 +41,36 @@ Tensor::Tensor(const Tensor& rhs) : size(rhs.size), shape(rhs.shape) {
     cblas_dcopy(size_i, rhs.data.get(), 1, data.get(), 1);
 }
 
+Tensor::Tensor(Tensor&& rhs) noexcept
+    : data(std::move(rhs.data)), size(rhs.size), shape(rhs.shape) {
+    rhs.size = 0;
+}
+
 Tensor::Tensor()
     : size(1), shape{{1,1,1,1}} {
     data = make_unique<double[]>(1);
 }
 
+Tensor::Tensor(double* memory, const Shape& shape_)
+    : data(memory, Buffer(false)), shape(shape_) {
+    size = accumulate(shape.begin(), shape.end(), static_cast<size_t>(1), std::multiplies<>());
+}
+
+void Tensor::resize(const Shape& shape_) {
+    auto new_size = accumulate(shape_.begin(), shape_.end(), static_cast<size_t>(1), std::multiplies<>());
+    if(new_size != size) {
+        data = make_unique<double[]>(new_size);
+        size = new_size;
+    }
+    shape = shape_;
+}
+
+void Tensor::bind(double* memory, const Shape& shape_) {
+    data = std::unique_ptr<double[], Buffer>(memory, Buffer(false));
+    shape = shape_;
+    size = accumulate(shape.begin(), shape.end(), static_cast<size_t>(1), std::multiplies<>());
+}
+
 double &Tensor::operator()(size_t x, size_t y, size_t z, size_t t) {
     if(shape[0] <= x) throw invalid_argument("x is outside the tensor");
     if(shape[1] <= y) throw invalid_argument("y is outside the tensor");
@@ -0,0 +1,50 @@
+/**
+    Tensor norm
+    Statistics for normalising tensors
+*/
+#include "tensor.hpp"
+
+#include <stdexcept>
+#include <vector>
+
+namespace nn{
+
+// Welford's update keeps the running mean and the sum of squared
+// deviations from it, so both come out of a single numerically stable pass.
+// Rows are contiguous and walked one at a time, columns are walked in
+// memory order with a running state per column.
+void moments(const Tensor& x, Tensor& mean, Tensor& var, bool per_row){
+    auto cols = x.shape[0];
+    auto rows = x.size / cols;
+    auto groups = per_row ? rows : cols;
+    if(mean.size != groups || var.size != groups) throw std::invalid_argument("Moments need one value per group");
+    auto x_ptr = x.ptr();
+    auto m_ptr = mean.ptr();
+    auto v_ptr = var.ptr();
+    if(per_row) {
+        for(size_t r=0; r<rows; ++r) {
+            auto row = x_ptr + r * cols;
+            double m = 0, s = 0;
+            for(size_t c=0; c<cols; ++c) {
+                auto delta = row[c] - m;
+                m += delta / (c + 1);
+                s += delta * (row[c] - m);
+            }
+            m_ptr[r] = m;
+            v_ptr[r] = s / cols;
+        }
+        return;
+    }
+    std::vector<double> s(cols, 0);
+    for(size_t c=0; c<cols; ++c) m_ptr[c] = 0;
+    for(size_t r=0; r<rows; ++r) {
+        auto row = x_ptr + r * cols;
+        for(size_t c=0; c<cols; ++c) {
+            auto delta = row[c] - m_ptr[c];
+            m_ptr[c] += delta / (r + 1);
+            s[c] += delta * (row[c] - m_ptr[c]);
+        }
+    }
+    for(size_t c=0; c<cols; ++c) v_ptr[c] = s[c] / rows;
+}
+} // namespace nn
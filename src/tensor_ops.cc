@@ -29,6 +29,17 @@ void Tensor::operator=(const Tensor& rhs) {
     cblas_dcopy(size_i, rhs.data.get(), 1, data.get(),1);
 }
 
+void Tensor::operator=(Tensor&& rhs) {
+    // Views keep writing to the memory they were made over
+    if(is_view()) {
+        *this = static_cast<const Tensor&>(rhs);
+        return;
+    }
+    data.swap(rhs.data);
+    std::swap(size, rhs.size);
+    std::swap(shape, rhs.shape);
+}
+
 Tensor Tensor::operator+(const Tensor& rhs) const {
     if(shape != rhs.shape) throw invalid_argument(size_err);
     Tensor result(*this);
@@ -41,35 +52,37 @@ Tensor Tensor::operator-(const Tensor& rhs)const {
     if(shape != rhs.shape) throw invalid_argument(size_err);
     Tensor result(*this);
     auto size_i = static_cast<int>(size);
-    catlas_daxpby(size_i, 1, rhs.data.get(), 1, -1, result.data.get(), 1);
+    catlas_daxpby(size_i, -1, rhs.data.get(), 1, 1, result.data.get(), 1);
     return result;
 }
 
 // Tensor multiplication is messier due to the decision tree for BLAS funcs so
 // isn't inlined like the rest
 Tensor Tensor::operator*(const Tensor& rhs) const {
-    if(shape[0] != rhs.shape[1]) throw invalid_argument(size_err);
-
     Tensor result(rhs.shape[0], shape[1]);
-    auto A = data.get();
-    auto A_c = static_cast<int>(shape[0]);
-    auto A_r = static_cast<int>(shape[1]);
+    matmul(*this, rhs, result);
+    return result;
+}
+
+// Writes lhs * rhs into result, which must already have the product's shape
+void matmul(const Tensor& lhs, const Tensor& rhs, Tensor& result) {
+    if(lhs.shape[0] != rhs.shape[1]) throw invalid_argument(size_err);
+    if(result.shape[0] != rhs.shape[0] || result.shape[1] != lhs.shape[1]) throw invalid_argument(size_err);
+
+    auto A = lhs.data.get();
+    auto A_c = static_cast<int>(lhs.shape[0]);
+    auto A_r = static_cast<int>(lhs.shape[1]);
     auto X = rhs.data.get();
     auto X_c = static_cast<int>(rhs.shape[0]);
-    auto X_r = static_cast<int>(rhs.shape[1]);
     auto Y = result.data.get();
-    auto Y_c = static_cast<int>(result.shape[0]);
 
-    if(shape[0] == 1) {
-        cblas_dgemv(CblasRowMajor, CblasNoTrans, A_r, A_c, 1, A, A_c, X, 1, 1, Y, 1);
-    }
-    else if(rhs.shape[0] == 1) {
-        cblas_dgemv(CblasRowMajor, CblasNoTrans, X_r, X_c, 1, X, A_c, A, 1, 1, Y, 1);
+    // A single column on the right is a matrix-vector product
+    if(X_c == 1) {
+        cblas_dgemv(CblasRowMajor, CblasNoTrans, A_r, A_c, 1, A, A_c, X, 1, 0, Y, 1);
     }
     else {
-        cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, A_r, X_c, A_c, 1, A, A_c, X, X_c, 1, Y, Y_c);
+        cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, A_r, X_c, A_c, 1, A, A_c, X, X_c, 0, Y, X_c);
     }
-    return result;
 }
 
 Tensor Tensor::operator/(const Tensor& rhs) const {
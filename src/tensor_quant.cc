@@ -0,0 +1,79 @@
+/**
+    Tensor quant
+    Integer kernels for int8 quantized inference
+*/
+#include "tensor.hpp"
+
+#include <stdexcept>
+#include <string>
+
+#ifdef __AVX512VNNI__
+#include <immintrin.h>
+#endif // __AVX512VNNI__
+
+namespace nn{
+
+#ifdef __AVX512VNNI__
+// Sum of the 32 bit lanes of a register
+static std::int32_t total(__m512i s) {
+    alignas(64) std::int32_t lanes[16];
+    _mm512_store_si512(lanes, s);
+    std::int32_t sum = 0;
+    for(auto lane : lanes) sum += lane;
+    return sum;
+}
+
+// Each weight row is loaded once for four samples, vpdpbusd multiplies the
+// unsigned input bytes by the signed weights and adds each group of four
+// products into a 32 bit lane
+static void kernel(const std::int8_t* weight, const std::uint8_t* x, size_t out, size_t in, size_t batch,
+                   std::int32_t* acc) {
+    for(size_t o=0; o<out; ++o) {
+        auto w = weight + o * in;
+        size_t b = 0;
+        for(; b + 4 <= batch; b += 4) {
+            auto x0 = x + b * in, x1 = x0 + in, x2 = x1 + in, x3 = x2 + in;
+            auto s0 = _mm512_setzero_si512(), s1 = s0, s2 = s0, s3 = s0;
+            for(size_t i=0; i<in; i+=quant_block) {
+                auto w_i = _mm512_loadu_si512(w + i);
+                s0 = _mm512_dpbusd_epi32(s0, _mm512_loadu_si512(x0 + i), w_i);
+                s1 = _mm512_dpbusd_epi32(s1, _mm512_loadu_si512(x1 + i), w_i);
+                s2 = _mm512_dpbusd_epi32(s2, _mm512_loadu_si512(x2 + i), w_i);
+                s3 = _mm512_dpbusd_epi32(s3, _mm512_loadu_si512(x3 + i), w_i);
+            }
+            acc[o * batch + b] = total(s0);
+            acc[o * batch + b + 1] = total(s1);
+            acc[o * batch + b + 2] = total(s2);
+            acc[o * batch + b + 3] = total(s3);
+        }
+        for(; b<batch; ++b) {
+            auto s = _mm512_setzero_si512();
+            for(size_t i=0; i<in; i+=quant_block) {
+                s = _mm512_dpbusd_epi32(s, _mm512_loadu_si512(x + b * in + i), _mm512_loadu_si512(w + i));
+            }
+            acc[o * batch + b] = total(s);
+        }
+    }
+}
+#else
+// Widening the bytes before multiplying lets the compiler vectorise the
+// inner loop with whatever integer instructions the target has
+static void kernel(const std::int8_t* weight, const std::uint8_t* x, size_t out, size_t in, size_t batch,
+                   std::int32_t* acc) {
+    for(size_t o=0; o<out; ++o) {
+        auto w = weight + o * in;
+        for(size_t b=0; b<batch; ++b) {
+            auto x_b = x + b * in;
+            std::int32_t s = 0;
+            for(size_t i=0; i<in; ++i) s += static_cast<std::int32_t>(x_b[i]) * static_cast<std::int32_t>(w[i]);
+            acc[o * batch + b] = s;
+        }
+    }
+}
+#endif // __AVX512VNNI__
+
+void qgemm(const std::int8_t* weight, const std::uint8_t* x, size_t out, size_t in, size_t batch, std::int32_t* acc) {
+    if(in % quant_block) throw std::invalid_argument("Quantized rows must be padded to a multiple of " + std::to_string(quant_block) + " values");
+    kernel(weight, x, out, in, batch, acc);
+}
+} // namespace nn
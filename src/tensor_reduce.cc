@@ -3,8 +3,8 @@
 #include <Accelerate/Accelerate.h>
 
 namespace nn{
-double Tensor::abs_sum(){ return cblas_dasum(size, data.get(), 1); }
-double Tensor::sum(){
+double Tensor::abs_sum() const { return cblas_dasum(size, data.get(), 1); }
+double Tensor::sum() const {
     auto C = std::make_unique<double>();
     vDSP_sveD(data.get(), 1, C.get(), size);
     return *C;
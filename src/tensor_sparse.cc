@@ -0,0 +1,193 @@
+/**
+    Tensor sparse
+    Compressed sparse row matrices and their products with dense tensors
+*/
+#include "sparse.hpp"
+#include "pool.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+
+namespace nn{
+
+static std::string shape_err = "Sparse products need matching inner dimensions and a result of the right shape";
+static std::string coo_err = "Sparse coordinates need a row, column and value per entry within the shape";
+
+// Multiply-adds below which a product isn't worth splitting between threads
+static const size_t min_work = 1 << 15;
+
+// Pool of the calling thread, which runs a share of the rows itself
+static thread_local std::unique_ptr<autodiff::WorkerPool> pool;
+
+static size_t rows_of(const Shape& shape) { return shape[1] * shape[2] * shape[3]; }
+
+// Runs fn over blocks of n rows, in parallel when there's work enough.
+// Blocks are a few per thread so uneven rows still balance.
+template<typename Fn>
+static void for_rows(size_t n, size_t work, Fn fn) {
+    if(!pool || work < min_work || n < 2) {
+        fn(0, n);
+        return;
+    }
+    auto blocks = std::min(n, 4 * (pool->size() + 1));
+    for(size_t k=0; k<blocks; ++k) {
+        auto begin = n * k / blocks, end = n * (k + 1) / blocks;
+        pool->submit([=]{ fn(begin, end); });
+    }
+    pool->wait();
+}
+
+SparseTensor::SparseTensor(const Shape& shape_) : shape(shape_), starts(rows_of(shape_) + 1, 0) {}
+
+// Entries are counted into rows, sorted by column within each row and
+// merged where a coordinate repeats
+SparseTensor::SparseTensor(const Shape& shape_, const std::vector<size_t>& row_ids,
+                           const std::vector<size_t>& col_ids, const std::vector<double>& values_)
+: SparseTensor(shape_) {
+    auto n = row_ids.size();
+    if(col_ids.size() != n || values_.size() != n) throw std::invalid_argument(coo_err);
+    auto height = rows_of(shape);
+    for(size_t e=0; e<n; ++e) {
+        if(row_ids[e] >= height || col_ids[e] >= shape[0]) throw std::invalid_argument(coo_err);
+        ++starts[row_ids[e] + 1];
+    }
+    std::partial_sum(starts.begin(), starts.end(), starts.begin());
+    std::vector<size_t> order(n), next(starts.begin(), starts.end() - 1);
+    for(size_t e=0; e<n; ++e) order[next[row_ids[e]]++] = e;
+    std::vector<size_t> merged(1, 0);
+    for(size_t r=0; r<height; ++r) {
+        auto first = order.begin() + static_cast<std::ptrdiff_t>(starts[r]);
+        auto last = order.begin() + static_cast<std::ptrdiff_t>(starts[r + 1]);
+        std::sort(first, last, [&](size_t a, size_t b){ return col_ids[a] < col_ids[b]; });
+        for(auto e=first; e!=last; ++e) {
+            if(e != first && col_ids[*e] == cols.back()) vals.back() += values_[*e];
+            else {
+                cols.push_back(col_ids[*e]);
+                vals.push_back(values_[*e]);
+            }
+        }
+        merged.push_back(cols.size());
+        if(merged[r + 1] > merged[r]) rows.push_back(r);
+    }
+    starts.swap(merged);
+}
+
+SparseTensor::SparseTensor(const Tensor& x) : SparseTensor(x.shape) {
+    auto width = shape[0];
+    auto values = x.ptr();
+    for(size_t r=0; r+1<starts.size(); ++r) {
+        for(size_t c=0; c<width; ++c) {
+            if(values[r * width + c] == 0) continue;
+            cols.push_back(c);
+            vals.push_back(values[r * width + c]);
+        }
+        starts[r + 1] = cols.size();
+        if(starts[r + 1] > starts[r]) rows.push_back(r);
+    }
+}
+
+std::vector<size_t> SparseTensor::coo_rows() const {
+    std::vector<size_t> row_ids(nnz());
+    for(auto r : rows) std::fill(row_ids.begin() + starts[r], row_ids.begin() + starts[r + 1], r);
+    return row_ids;
+}
+
+Tensor SparseTensor::dense() const {
+    Tensor out(shape, 0);
+    for(auto r : rows) {
+        for(auto e=starts[r]; e<starts[r + 1]; ++e) out.ptr()[r * shape[0] + cols[e]] = vals[e];
+    }
+    return out;
+}
+
+// Each row of the result is the sum of the rows of b picked by the entries
+// of the same row of a
+void matmul(const SparseTensor& a, const Tensor& b, Tensor& out) {
+    auto n = b.shape[0], m = rows_of(a.shape);
+    if(a.shape[0] != b.size / n || out.shape[0] != n || out.size != m * n) throw std::invalid_argument(shape_err);
+    auto &starts = a.row_starts();
+    auto &cols = a.columns();
+    auto &vals = a.values();
+    auto b_ptr = b.ptr(), o_ptr = out.ptr();
+    for_rows(m, a.nnz() * n, [&](size_t begin, size_t end) {
+        for(size_t r=begin; r<end; ++r) {
+            auto o = o_ptr + r * n;
+            std::fill(o, o + n, 0);
+            for(auto e=starts[r]; e<starts[r + 1]; ++e) {
+                auto v = vals[e];
+                auto row = b_ptr + cols[e] * n;
+                for(size_t j=0; j<n; ++j) o[j] += v * row[j];
+            }
+        }
+    });
+}
+
+// Row o of the result gathers a[o][i] * b[i][j] over the entries of b, so
+// the empty rows of b cost nothing
+void matmul(const Tensor& a, const SparseTensor& b, Tensor& out) {
+    auto k = a.shape[0], m = a.size / k, n = b.shape[0];
+    if(rows_of(b.shape) != k || out.shape[0] != n || out.size != m * n) throw std::invalid_argument(shape_err);
+    auto &starts = b.row_starts();
+    auto &cols = b.columns();
+    auto &vals = b.values();
+    auto &rows = b.occupied();
+    auto a_ptr = a.ptr(), o_ptr = out.ptr();
+    for_rows(m, b.nnz() * m, [&](size_t begin, size_t end) {
+        for(size_t r=begin; r<end; ++r) {
+            auto o = o_ptr + r * n;
+            std::fill(o, o + n, 0);
+            for(auto i : rows) {
+                auto w = a_ptr[r * k + i];
+                if(w == 0) continue;
+                for(auto e=starts[i]; e<starts[i + 1]; ++e) o[cols[e]] += w * vals[e];
+            }
+        }
+    });
+}
+
+// out[o][i] gains the sparse dot product of row o of a with row i of b
+void matmul_add_t(const Tensor& a, const SparseTensor& b, Tensor& out) {
+    auto n = a.shape[0], m = a.size / n, k = rows_of(b.shape);
+    if(b.shape[0] != n || out.shape[0] != k || out.size != m * k) throw std::invalid_argument(shape_err);
+    auto &starts = b.row_starts();
+    auto &cols = b.columns();
+    auto &vals = b.values();
+    auto &rows = b.occupied();
+    auto a_ptr = a.ptr(), o_ptr = out.ptr();
+    for_rows(m, b.nnz() * m, [&](size_t begin, size_t end) {
+        for(size_t r=begin; r<end; ++r) {
+            auto g = a_ptr + r * n;
+            for(auto i : rows) {
+                double sum = 0;
+                for(auto e=starts[i]; e<starts[i + 1]; ++e) sum += g[cols[e]] * vals[e];
+                o_ptr[r * k + i] += sum;
+            }
+        }
+    });
+}
+
+Tensor operator*(const SparseTensor& a, const Tensor& b) {
+    Tensor out(b.shape[0], rows_of(a.shape));
+    matmul(a, b, out);
+    return out;
+}
+
+Tensor operator*(const Tensor& a, const SparseTensor& b) {
+    Tensor out(b.shape[0], a.size / a.shape[0]);
+    matmul(a, b, out);
+    return out;
+}
+
+void set_sparse_threads(size_t n) {
+    if(n == 0) throw std::invalid_argument("Sparse products need at least one thread");
+    // The calling thread takes part, so the pool only holds the extra ones
+    if(n == 1) pool.reset();
+    else if(!pool || pool->size() != n - 1) pool.reset(new autodiff::WorkerPool(n - 1));
+}
+
+size_t sparse_threads() { return pool ? pool->size() + 1 : 1; }
+
+} // namespace nn